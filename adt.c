@@ -0,0 +1,538 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+//  The SSC data register is a pair of multicore FIFOs, what the 6502 writes
+//  shows up in core0's read FIFO and what core0 pushes the 6502 reads. Usually
+//  ser.c bridges them to the USB CDC port and the ADTPro server runs on a PC.
+//  With adtpro=1 in A2retroNET.txt we answer the ADTPro client on the Apple II
+//  ourselves and read and write disk images on the SD card or the thumb drive.
+//  Transfers then run as fast as the client polls the register.
+//
+//  The ProDOS client's requests, the command is sent with the high bit set:
+//    D                   Directory, a page of text ending in $00 and a more flag,
+//                        ACK asks for the next page
+//    C name $00          Change directory, answers a result code
+//    Z name $00          Size, answers the blocks (lo, hi) and a result code
+//    G name $00          Get, answers a result code, ACK starts the half blocks
+//    P name $00 lo hi    Put that many blocks, answers a result code, then
+//                        receives half blocks
+//  A half block is 256 bytes, each XORed with the one before. A zero is
+//  followed by the number of further zeros. The CRC-16 of the raw data comes
+//  last, the receiver answers ACK or NAK and a NAK repeats the half block.
+//  After a failed write every half block gets a NAK until the client gives up.
+//  The DOS ADT commands (S, R) and batch, nibble and half track transfers
+//  aren't served. tools/adttest replays a session against this file.
+
+#include "adt.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <pico/multicore.h>
+#include <f_util.h>
+
+#include "config.h"
+#include "hdd.h"
+#include "diskio.h"
+
+#define ADT_BLOCK       512
+#define ADT_HALF        256
+#define ADT_PAGE_LINES  20          //  Directory lines per page
+#define ADT_TIMEOUT_MS  10000       //  Abandon a transfer the client stopped answering
+#define ADT_FAILED_MS   1000        //  Back to commands once the client gave up on a failed put
+#define ADT_QUEUE       1024        //  Output bytes, power of 2
+
+#define ADT_ACK         0x06
+#define ADT_NAK         0x15
+
+#define ADT_OK          0x00
+#define ADT_NOT_FOUND   0x02
+#define ADT_IO_ERROR    0x04
+
+enum {
+    STATE_IDLE,
+    STATE_NAME,
+    STATE_SIZE,
+    STATE_DIR,                      //  Waiting for the client to ask for the next page
+    STATE_START,                    //  Waiting for the client to take the first half block
+    STATE_SEND,                     //  Waiting for ACK or NAK
+    STATE_RECEIVE
+};
+
+static struct {
+    int      state;
+    char     command;
+    char     name[MAX_PATH];
+    int      length;                //  Of name, or size bytes received
+    uint16_t size;
+    char     dir[MAX_PATH];         //  Current directory, empty for the default drive's root
+    FIL      image;
+    DIR      listing;
+    uint32_t halves;                //  Half blocks of the image
+    uint32_t half;                  //  Half block being transferred
+    uint8_t  data[ADT_BLOCK];       //  Block the half belongs to
+    int      pos;                   //  Receive decoder
+    uint8_t  prev;
+    bool     run;
+    bool     bad;
+    bool     failed;                //  Writing the image failed, every half block is refused
+    uint8_t  crc[2];
+    int      crc_pos;
+    absolute_time_t timeout;
+    uint8_t  queue[ADT_QUEUE];
+    uint16_t head;
+    uint16_t tail;
+} adt;
+
+static void put(uint8_t data) {
+    adt.queue[adt.head++ & (ADT_QUEUE - 1)] = data;
+}
+
+static void put_text(const char *text) {
+    while (*text) {
+        put(*text++ | 0x80);
+    }
+}
+
+static void flush(void) {
+    while (adt.tail != adt.head && multicore_fifo_wready()) {
+        multicore_fifo_push_blocking(adt.queue[adt.tail++ & (ADT_QUEUE - 1)]);
+    }
+}
+
+static uint16_t crc16(const uint8_t *data, int length) {
+    uint16_t crc = 0;
+
+    for (int i = 0; i < length; i++) {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void make_path(char *path, const char *name) {
+    if (strchr(name, ':') || name[0] == '/') {
+        snprintf(path, MAX_PATH, "%s", name);
+    } else {
+        snprintf(path, MAX_PATH, "%s/%s", adt.dir, name);
+    }
+}
+
+static void stop(void) {
+    if (adt.state == STATE_START || adt.state == STATE_SEND || adt.state == STATE_RECEIVE) {
+        FRESULT fr = f_close(&adt.image);
+        if (fr != FR_OK) {
+            printf("f_close(%s) error: %s (%d)\n", adt.name, FRESULT_str(fr), fr);
+        }
+    }
+    if (adt.state == STATE_DIR) {
+        f_closedir(&adt.listing);
+    }
+    adt.state = STATE_IDLE;
+    adt.failed = false;
+}
+
+static void send_page(void) {
+    for (int line = 0; line < ADT_PAGE_LINES; line++) {
+        FILINFO fno;
+        FRESULT fr = f_readdir(&adt.listing, &fno);
+        if (fr != FR_OK || !fno.fname[0]) {
+            put(0x00);
+            put(0x00);              //  No more pages
+            f_closedir(&adt.listing);
+            adt.state = STATE_IDLE;
+            return;
+        }
+
+        char text[40];
+        if (fno.fattrib & AM_DIR) {
+            snprintf(text, sizeof(text), "%.30s/\r", fno.fname);
+        } else {
+            snprintf(text, sizeof(text), "%-30.30s %5lu\r", fno.fname, (unsigned long)(fno.fsize / ADT_BLOCK));
+        }
+        put_text(text);
+    }
+    put(0x00);
+    put(0x01);                      //  More pages
+    adt.state = STATE_DIR;
+}
+
+static void do_dir(void) {
+    FRESULT fr = f_opendir(&adt.listing, adt.dir[0] ? adt.dir : "/");
+    if (fr != FR_OK) {
+        printf("f_opendir(%s) error: %s (%d)\n", adt.dir, FRESULT_str(fr), fr);
+        put(0x00);
+        put(0x00);
+        adt.state = STATE_IDLE;
+        return;
+    }
+    send_page();
+}
+
+static void do_cd(void) {
+    char path[MAX_PATH];
+
+    if (!strcmp(adt.name, "..")) {
+        snprintf(path, MAX_PATH, "%s", adt.dir);
+        char *slash = strrchr(path, '/');
+        if (slash) {
+            *slash = '\0';
+        }
+    } else {
+        make_path(path, adt.name);
+    }
+
+    int length = strlen(path);
+    if (length && path[length - 1] == '/') {
+        path[length - 1] = '\0';
+    }
+
+    DIR dir;
+    FRESULT fr = f_opendir(&dir, path[0] ? path : "/");
+    if (fr != FR_OK) {
+        put(ADT_NOT_FOUND);
+        return;
+    }
+    f_closedir(&dir);
+
+    strcpy(adt.dir, path);
+    printf("ADT CD(Dir=%s)\n", adt.dir);
+    put(ADT_OK);
+}
+
+static void do_size(void) {
+    char path[MAX_PATH];
+    make_path(path, adt.name);
+
+    FILINFO fno;
+    if (f_stat(path, &fno) != FR_OK || fno.fattrib & AM_DIR) {
+        put(0x00);
+        put(0x00);
+        put(ADT_NOT_FOUND);
+        return;
+    }
+
+    uint32_t blocks = fno.fsize / ADT_BLOCK;
+    if (blocks > 0xFFFF) {
+        blocks = 0xFFFF;
+    }
+    put(blocks % 0x100);
+    put(blocks / 0x100);
+    put(ADT_OK);
+}
+
+static bool read_data(void) {
+    UINT br;
+    FRESULT fr = f_read(&adt.image, adt.data, ADT_BLOCK, &br);
+    if (fr != FR_OK || br != ADT_BLOCK) {
+        printf("f_read(%s) error: %s (%d)\n", adt.name, FRESULT_str(fr), fr);
+        return false;
+    }
+    return true;
+}
+
+static void send_half(void) {
+    const uint8_t *data = &adt.data[(adt.half & 1) * ADT_HALF];
+    uint8_t prev = 0;
+
+    for (int i = 0; i < ADT_HALF;) {
+        uint8_t diff = data[i] ^ prev;
+        prev = data[i++];
+        if (diff) {
+            put(diff);
+            continue;
+        }
+        uint8_t zeros = 0;
+        while (i < ADT_HALF && data[i] == prev && zeros < 0xFF) {
+            zeros++;
+            i++;
+        }
+        put(0x00);
+        put(zeros);
+    }
+
+    uint16_t crc = crc16(data, ADT_HALF);
+    put(crc % 0x100);
+    put(crc / 0x100);
+}
+
+static void do_get(void) {
+    char path[MAX_PATH];
+    make_path(path, adt.name);
+
+    FRESULT fr = f_open(&adt.image, path, FA_OPEN_EXISTING | FA_READ);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        put(ADT_NOT_FOUND);
+        return;
+    }
+
+    printf("ADT Get(File=%s)\n", path);
+    adt.halves = f_size(&adt.image) / ADT_BLOCK * 2;
+    if (adt.halves > 0xFFFF * 2) {
+        adt.halves = 0xFFFF * 2;
+    }
+    adt.half = 0;
+    adt.state = STATE_SEND;
+
+    if (!adt.halves) {
+        put(ADT_OK);
+        stop();
+        return;
+    }
+    if (!read_data()) {
+        put(ADT_IO_ERROR);
+        stop();
+        return;
+    }
+    put(ADT_OK);
+    adt.state = STATE_START;
+}
+
+static void sent(uint8_t answer) {
+    if (answer == ADT_NAK) {
+        send_half();
+        return;
+    }
+    if (answer != ADT_ACK) {
+        stop();
+        return;
+    }
+
+    if (++adt.half == adt.halves) {
+        printf("ADT Sent(Blocks=%lu)\n", adt.halves / 2);
+        stop();
+        return;
+    }
+    if (!(adt.half & 1) && !read_data()) {
+        stop();
+        return;
+    }
+    send_half();
+}
+
+static void start_half(void) {
+    adt.pos = 0;
+    adt.prev = 0;
+    adt.run = false;
+    adt.bad = false;
+    adt.crc_pos = 0;
+}
+
+static void do_put(void) {
+    char path[MAX_PATH];
+    make_path(path, adt.name);
+
+    //  The image may be in use as a drive
+    disk_flush();
+    hdd_reset();
+
+    FRESULT fr = f_open(&adt.image, path, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        put(ADT_IO_ERROR);
+        return;
+    }
+
+    printf("ADT Put(File=%s,Blocks=%u)\n", path, adt.size);
+    put(ADT_OK);
+    adt.halves = adt.size * 2;
+    adt.half = 0;
+    adt.state = STATE_RECEIVE;
+    start_half();
+
+    if (!adt.halves) {
+        stop();
+    }
+}
+
+static void received(uint8_t data) {
+    uint8_t *half = &adt.data[(adt.half & 1) * ADT_HALF];
+
+    if (adt.pos < ADT_HALF) {
+        if (adt.run) {
+            adt.run = false;
+            if (adt.pos + data > ADT_HALF) {
+                adt.bad = true;
+                data = ADT_HALF - adt.pos;
+            }
+            memset(&half[adt.pos], adt.prev, data);
+            adt.pos += data;
+        } else if (!data) {
+            half[adt.pos++] = adt.prev;
+            adt.run = true;
+        } else {
+            adt.prev ^= data;
+            half[adt.pos++] = adt.prev;
+        }
+        return;
+    }
+
+    //  A run may still follow the last byte
+    if (adt.run) {
+        adt.run = false;
+        adt.bad |= data != 0;
+        return;
+    }
+
+    adt.crc[adt.crc_pos++] = data;
+    if (adt.crc_pos < 2) {
+        return;
+    }
+
+    if (adt.bad || crc16(half, ADT_HALF) != (adt.crc[0] | adt.crc[1] << 8)) {
+        put(ADT_NAK);
+        start_half();
+        return;
+    }
+
+    if (adt.half & 1 && !adt.failed) {
+        UINT bw;
+        FRESULT fr = f_write(&adt.image, adt.data, ADT_BLOCK, &bw);
+        if (fr != FR_OK || bw != ADT_BLOCK) {
+            printf("f_write(%s) error: %s (%d)\n", adt.name, FRESULT_str(fr), fr);
+            adt.failed = true;
+        }
+    }
+    //  The client repeats a refused half block until it runs out of retries
+    if (adt.failed) {
+        put(ADT_NAK);
+        start_half();
+        return;
+    }
+    put(ADT_ACK);
+
+    if (++adt.half == adt.halves) {
+        printf("ADT Received(Blocks=%lu)\n", adt.halves / 2);
+        stop();
+        return;
+    }
+    start_half();
+}
+
+static void command(uint8_t data) {
+    switch (adt.state) {
+        case STATE_IDLE:
+            adt.command = data & 0x7F;
+            adt.length = 0;
+            switch (adt.command) {
+                case 'D':
+                    do_dir();
+                    break;
+                case 'C':
+                case 'Z':
+                case 'G':
+                case 'P':
+                    adt.state = STATE_NAME;
+                    break;
+            }
+            break;
+        case STATE_NAME:
+            data &= 0x7F;
+            if (data) {
+                if (adt.length < MAX_PATH - 1) {
+                    adt.name[adt.length++] = data;
+                }
+                break;
+            }
+            adt.name[adt.length] = '\0';
+            adt.state = STATE_IDLE;
+            switch (adt.command) {
+                case 'C':
+                    do_cd();
+                    break;
+                case 'Z':
+                    do_size();
+                    break;
+                case 'G':
+                    do_get();
+                    break;
+                case 'P':
+                    adt.length = 0;
+                    adt.state = STATE_SIZE;
+                    break;
+            }
+            break;
+        case STATE_SIZE:
+            if (!adt.length++) {
+                adt.size = data;
+                break;
+            }
+            adt.size |= data << 8;
+            adt.state = STATE_IDLE;
+            do_put();
+            break;
+        case STATE_DIR:
+            if (data == ADT_ACK) {
+                send_page();
+                break;
+            }
+            //  The client has seen enough, the byte is its next request
+            stop();
+            command(data);
+            break;
+        case STATE_START:
+            if (data != ADT_ACK) {
+                stop();
+                break;
+            }
+            adt.state = STATE_SEND;
+            send_half();
+            break;
+        case STATE_SEND:
+            sent(data);
+            break;
+        case STATE_RECEIVE:
+            received(data);
+            break;
+    }
+}
+
+bool adt_task(void) {
+    if (!config_adtpro()) {
+        stop();
+        return false;
+    }
+
+    while (true) {
+        flush();
+        if (adt.tail != adt.head || !multicore_fifo_rvalid()) {
+            break;
+        }
+        command(multicore_fifo_pop_blocking());
+        adt.timeout = make_timeout_time_ms(adt.failed ? ADT_FAILED_MS : ADT_TIMEOUT_MS);
+    }
+
+    if (adt.state != STATE_IDLE && absolute_time_diff_us(get_absolute_time(), adt.timeout) <= 0) {
+        printf("ADT Timeout\n");
+        stop();
+        adt.tail = adt.head;
+    }
+
+    return true;
+}
@@ -25,11 +25,16 @@ SOFTWARE.
 */
 
 #include "block_cache.h"
+#include "block_copy.h"
+#include "write_log.h"
 
 #include <ff.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <diskio.h>
 #include <stdbool.h>
+#include <pico/time.h>
 
 #if IO_STATS
 #include <stdio.h>
@@ -47,12 +52,19 @@ uint32_t s_block_cache_write_hit_count = 0;
 uint32_t s_block_cache_write_free_count = 0;
 uint32_t s_block_cache_write_evict_count = 0;
 uint32_t s_block_cache_write_flush_count = 0;
+uint32_t s_block_cache_urgent_count = 0;         //  Urgent flushes (reset, power fail)
+uint32_t s_block_cache_urgent_blocks = 0;
+uint32_t s_block_cache_urgent_max_us = 0;        //  Longest exposure window
+uint32_t s_block_cache_write_same_count = 0;     //  Identical to the cached copy
+uint32_t s_block_cache_write_saved_count = 0;    //  ... and the entry was clean, one SD program less
+uint32_t s_block_cache_write_staged_count = 0;   //  Appended to the write log instead
 #endif
 
 
 #define BLOCK_SIZE          512
 #define CACHE_SIZE          128          // Number of cache entries, 128 = 64K bytes
 #define HASH_SIZE           257          // Prime number bucket count
+#define FLUSH_RUN_SIZE      8            // Sectors per multi-sector write in an urgent flush
 
 /* -------------------------------
     cache_entry
@@ -263,11 +275,15 @@ DRESULT block_cache_read_block(BYTE pdrv, LBA_t sector, BYTE *out_data)
 
     if (e) 
     {
-        //  Cache hit
+        //  Cache hit, overlap the copy with the LRU update
+        bool copying = false;
+        if(out_data != NULL)
+            copying = block_copy_start(out_data, e->data, BLOCK_SIZE);
+
         lru_touch(e);
 
-        if(out_data != NULL)
-            memcpy(out_data, e->data, BLOCK_SIZE);
+        if (copying)
+            block_copy_wait();
 
 #if IO_STATS
     if (out_data != NULL)
@@ -307,6 +323,10 @@ DRESULT block_cache_read_block(BYTE pdrv, LBA_t sector, BYTE *out_data)
     if (result != RES_OK)
         return result;
 
+    bool copying = false;
+    if(out_data != NULL)
+        copying = block_copy_start(out_data, free_entry->data, BLOCK_SIZE);
+
     free_entry->sector = sector;
     free_entry->pdrv = pdrv;
     free_entry->dirty = false;
@@ -316,8 +336,8 @@ DRESULT block_cache_read_block(BYTE pdrv, LBA_t sector, BYTE *out_data)
     hash_insert(free_entry);
     lru_insert_front(free_entry);
     
-    if(out_data != NULL)
-        memcpy(out_data, free_entry->data, BLOCK_SIZE);
+    if (copying)
+        block_copy_wait();
     
     return RES_OK;
 }
@@ -332,12 +352,26 @@ DRESULT block_cache_write_block(BYTE pdrv, LBA_t sector, const BYTE *in_data)
 
     if (e) 
     {
-        //  Cache hit
-        memcpy(e->data, in_data, BLOCK_SIZE);
+        //  Cache hit, an identical block needs neither a copy nor a write back
+        if (memcmp(e->data, in_data, BLOCK_SIZE) == 0)
+        {
+#if IO_STATS
+            s_block_cache_write_same_count++;
+            if (!e->dirty)
+                s_block_cache_write_saved_count++;
+#endif
+            lru_touch(e);
+            return 0;
+        }
+
+        bool copying = block_copy_start(e->data, in_data, BLOCK_SIZE);
         e->dirty = true;
         s_dirty_blocks = true;
         lru_touch(e);
 
+        if (copying)
+            block_copy_wait();
+
 #if IO_STATS
             s_block_cache_write_hit_count++;
 #endif
@@ -367,7 +401,7 @@ DRESULT block_cache_write_block(BYTE pdrv, LBA_t sector, const BYTE *in_data)
     }
 
     //  No need to read from device for write
-    memcpy(free_entry->data, in_data, BLOCK_SIZE);
+    bool copying = block_copy_start(free_entry->data, in_data, BLOCK_SIZE);
     free_entry->sector = sector;
     free_entry->pdrv = pdrv;
     free_entry->dirty = true;
@@ -378,13 +412,75 @@ DRESULT block_cache_write_block(BYTE pdrv, LBA_t sector, const BYTE *in_data)
     hash_insert(free_entry);
     lru_insert_front(free_entry);
 
+    if (copying)
+        block_copy_wait();
+
     return 0;
 }
 
+//  Returns false if the write log didn't take them, they stay dirty
+static bool stage_run(cache_entry **run, UINT count)
+{
+    LBA_t sectors[WRITE_LOG_RUN];
+    const BYTE *data[WRITE_LOG_RUN];
+
+    for (UINT k=0; k<count; k++)
+    {
+        sectors[k] = run[k]->sector;
+        data[k] = run[k]->data;
+    }
+
+    if (write_log_append(run[0]->pdrv, count, sectors, data) != RES_OK)
+        return false;
+
+    for (UINT k=0; k<count; k++)
+        run[k]->dirty = false;
+#if IO_STATS
+    s_block_cache_write_staged_count += count;
+#endif
+    return true;
+}
+
+//  Append the drive's dirty sectors to the write log, what is left is written home by the caller
+static void stage_dirty(BYTE pdrv)
+{
+    cache_entry *run[WRITE_LOG_RUN];
+    UINT count = 0;
+
+    for (int i=0; i<=CACHE_SIZE; i++) 
+    {
+        if (i < CACHE_SIZE)
+        {
+            cache_entry *e = &s_cache[i];
+            if (!e->valid || !e->dirty || (e->pdrv != pdrv))
+                continue;
+
+            run[count++] = e;
+            if (count < WRITE_LOG_RUN)
+                continue;
+        }
+
+        if (count && !stage_run(run, count))
+            return;
+        count = 0;
+    }
+}
+
+bool block_cache_dirty(void)
+{
+    return s_dirty_blocks;
+}
+
 DRESULT block_cache_flush(bool flush_all, bool invalidate_all)
 {
     if (s_dirty_blocks == false)                    //  Optimization
         return RES_OK;
+
+    if (flush_all)
+    {
+        for (BYTE pdrv=0; pdrv<FF_VOLUMES; pdrv++)
+            stage_dirty(pdrv);
+    }
     
     for (int i=0; i<CACHE_SIZE; i++) 
     {
@@ -413,12 +509,149 @@ DRESULT block_cache_flush(bool flush_all, bool invalidate_all)
     return RES_OK;
 }
 
+static int dirty_compare(const void *p1, const void *p2)
+{
+    const cache_entry *e1 = *(const cache_entry **)p1;
+    const cache_entry *e2 = *(const cache_entry **)p2;
+
+    if (e1->pdrv != e2->pdrv)
+        return e1->pdrv < e2->pdrv ? -1 : 1;
+    if (e1->sector != e2->sector)
+        return e1->sector < e2->sector ? -1 : 1;
+    return 0;
+}
+
+//  Write back every dirty block right now, adjacent sectors with one multi-sector write
+DRESULT block_cache_flush_urgent(void)
+{
+    if (s_dirty_blocks == false)                    //  Optimization
+        return RES_OK;
+
+    static cache_entry *dirty[CACHE_SIZE];
+    static BYTE run[FLUSH_RUN_SIZE * BLOCK_SIZE];
+    uint32_t start = time_us_32();
+    int count = 0;
+
+    //  Sequential appends are the fastest way to get it onto the card
+    for (BYTE pdrv=0; pdrv<FF_VOLUMES; pdrv++)
+        stage_dirty(pdrv);
+
+    for (int i=0; i<CACHE_SIZE; i++) 
+    {
+        if (s_cache[i].valid && s_cache[i].dirty)
+            dirty[count++] = &s_cache[i];
+    }
+    qsort(dirty, count, sizeof(dirty[0]), dirty_compare);
+
+    for (int i=0; i<count; ) 
+    {
+        int n = 1;
+        while ((i + n < count) && (n < FLUSH_RUN_SIZE) &&
+               (dirty[i + n]->pdrv == dirty[i]->pdrv) && (dirty[i + n]->sector == dirty[i]->sector + n))
+            n++;
+
+        const BYTE *data = dirty[i]->data;
+        if (n > 1)
+        {
+            for (int k=0; k<n; k++)
+                memcpy(&run[k * BLOCK_SIZE], dirty[i + k]->data, BLOCK_SIZE);
+            data = run;
+        }
+
+        DRESULT result = disk_write_no_cache (dirty[i]->pdrv, data, dirty[i]->sector, n);
+        if (result != RES_OK)
+        {
+            return result;
+        }
+
+        for (int k=0; k<n; k++)
+            dirty[i + k]->dirty = false;
+        i += n;
+    }
+
+    s_dirty_blocks = false;                         //  Clear the flag
+
+    uint32_t us = time_us_32() - start;
+#if IO_STATS
+    s_block_cache_urgent_count++;
+    s_block_cache_urgent_blocks += count;
+    if (us > s_block_cache_urgent_max_us)
+        s_block_cache_urgent_max_us = us;
+#endif
+    printf("Urgent Flush(Blocks=%d,Us=%lu)\n", count, us);
+
+    return RES_OK;
+}
+
+//  Write back, and optionally drop, the cached sectors in [sector, sector + count)
+DRESULT block_cache_sync_range(BYTE pdrv, LBA_t sector, UINT count, bool invalidate)
+{
+    if ((s_dirty_blocks == false) && (invalidate == false))    //  Optimization
+        return RES_OK;
+
+    for (int i=0; i<CACHE_SIZE; i++) 
+    {
+        cache_entry *e = &s_cache[i];
+
+        if (!e->valid || (e->pdrv != pdrv) || (e->sector < sector) || (e->sector >= sector + count))
+            continue;
+
+        if (e->dirty) 
+        {
+            DRESULT result = disk_write_no_cache (e->pdrv, e->data, e->sector, 1);          //  1 is a 512 byte sector
+            if (result != RES_OK)
+            {
+                return result;
+            }
+#if IO_STATS
+            s_block_cache_write_flush_count++;
+#endif
+            e->dirty = false;
+        }
+
+        if (invalidate)
+        {
+            hash_remove(e);
+            lru_remove(e);
+            free_insert(e);
+        }
+    }
+
+    return RES_OK;
+}
+
+//  Returns 1 if the cached copy of the sector equals data, 0 if it differs, -1 if it isn't cached
+int block_cache_compare(BYTE pdrv, LBA_t sector, const BYTE *data)
+{
+    cache_entry *e = hash_lookup(pdrv, sector);
+
+    if (!e)
+        return -1;
+
+    return memcmp(e->data, data, BLOCK_SIZE) == 0;
+}
+
 void block_cache_print_stats(void)
 {
 #if IO_STATS
-    printf("block_cache:, Reads, %d, Ahead, %d, Hit, %d, Free, %d, Evict, %d, Miss, %d, ---, Writes, %d, Hit, %d, Free, %d, Evict, %d, Flush, %d,\n", 
+    printf("block_cache:, Reads, %d, Ahead, %d, Hit, %d, Free, %d, Evict, %d, Miss, %d, ---, Writes, %d, Hit, %d, Free, %d, Evict, %d, Flush, %d, Same, %d, Saved, %d, Staged, %d,\n", 
         s_block_cache_read_count, s_block_cache_read_ahead_count, s_block_cache_read_hit_count, s_block_cache_read_free_count, s_block_cache_read_evict_count, s_block_cache_read_miss_count,
-        s_block_cache_write_count, s_block_cache_write_hit_count, s_block_cache_write_free_count, s_block_cache_write_evict_count, s_block_cache_write_flush_count
+        s_block_cache_write_count, s_block_cache_write_hit_count, s_block_cache_write_free_count, s_block_cache_write_evict_count, s_block_cache_write_flush_count,
+        s_block_cache_write_same_count, s_block_cache_write_saved_count, s_block_cache_write_staged_count
         );
+    if (s_block_cache_urgent_count)
+        printf("block_cache:, Urgent, %d, Blocks, %d, Max us, %d,\n",
+            s_block_cache_urgent_count, s_block_cache_urgent_blocks, s_block_cache_urgent_max_us);
+#endif
+}
+
+void block_cache_get_stats(uint32_t *read_hits, uint32_t *read_misses)
+{
+#if IO_STATS
+    *read_hits = s_block_cache_read_hit_count;
+    *read_misses = s_block_cache_read_miss_count;
+#else
+    *read_hits = 0;
+    *read_misses = 0;
 #endif
 }
\ No newline at end of file
@@ -39,7 +39,15 @@ extern DRESULT block_cache_read_block(BYTE pdrv, LBA_t sector, BYTE *out_data);
 extern DRESULT block_cache_write_block(BYTE pdrv, LBA_t sector, const BYTE *in_data);
 
 extern DRESULT block_cache_flush(bool flush_all, bool invalidate_all);
+extern DRESULT block_cache_flush_urgent(void);
+extern bool block_cache_dirty(void);
+
+extern DRESULT block_cache_sync_range(BYTE pdrv, LBA_t sector, UINT count, bool invalidate);
+
+extern int block_cache_compare(BYTE pdrv, LBA_t sector, const BYTE *data);
 
 extern void block_cache_print_stats(void);
 
+extern void block_cache_get_stats(uint32_t *read_hits, uint32_t *read_misses);
+
 #endif //   _BLOCK_CACHE_H
\ No newline at end of file
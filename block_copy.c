@@ -0,0 +1,153 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include "block_copy.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <hardware/dma.h>
+
+#if IO_STATS
+#include <stdio.h>
+#include <hardware/clocks.h>
+#include <hardware/structs/systick.h>
+
+uint32_t s_block_copy_dma_count = 0;
+uint32_t s_block_copy_cpu_count = 0;
+
+uint32_t s_block_copy_memcpy_cycles = 0;        //  Per 512 bytes, measured once in block_copy_init
+uint32_t s_block_copy_dma_cycles = 0;
+uint32_t s_block_copy_start_cycles = 0;
+#endif
+
+
+#define BLOCK_COPY_MIN      256         //  Smaller copies are not worth the channel setup
+
+static int s_channel = -1;
+
+
+#if IO_STATS
+static uint32_t cycles_since(uint32_t start)
+{
+    return (start - systick_hw->cvr) & 0x00FFFFFF;
+}
+
+static void block_copy_benchmark(void)
+{
+    static uint32_t src[512 / 4];
+    static uint32_t dst[512 / 4];
+    uint32_t start;
+
+    systick_hw->rvr = 0x00FFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;          //  Processor clock, enabled
+
+    start = systick_hw->cvr;
+    memcpy(dst, src, sizeof(dst));
+    s_block_copy_memcpy_cycles = cycles_since(start);
+
+    start = systick_hw->cvr;
+    block_copy_start(dst, src, sizeof(dst));
+    s_block_copy_start_cycles = cycles_since(start);
+    block_copy_wait();
+    s_block_copy_dma_cycles = cycles_since(start);
+
+    s_block_copy_dma_count = 0;
+}
+#endif
+
+void block_copy_init(void)
+{
+    if (s_channel >= 0)
+        return;
+
+    s_channel = dma_claim_unused_channel(false);
+    if (s_channel < 0)
+        return;                     //  No channel left, everything goes through memcpy
+
+    dma_channel_config config = dma_channel_get_default_config(s_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, true);
+    dma_channel_configure(s_channel, &config, NULL, NULL, 0, false);
+
+#if IO_STATS
+    block_copy_benchmark();
+#endif
+}
+
+bool block_copy_start(void *dst, const void *src, size_t size)
+{
+    //  Small or unaligned copies are done by the CPU
+    if (s_channel < 0 || size < BLOCK_COPY_MIN || (((uintptr_t)dst | (uintptr_t)src | size) & 3))
+    {
+        memcpy(dst, src, size);
+#if IO_STATS
+        s_block_copy_cpu_count++;
+#endif
+        return false;
+    }
+
+    dma_channel_wait_for_finish_blocking(s_channel);    //  One copy at a time
+
+    dma_channel_set_read_addr(s_channel, src, false);
+    dma_channel_set_write_addr(s_channel, dst, false);
+    dma_channel_set_trans_count(s_channel, size / 4, true);
+
+#if IO_STATS
+    s_block_copy_dma_count++;
+#endif
+    return true;
+}
+
+void block_copy_wait(void)
+{
+    if (s_channel >= 0)
+        dma_channel_wait_for_finish_blocking(s_channel);
+}
+
+void block_copy(void *dst, const void *src, size_t size)
+{
+    if (block_copy_start(dst, src, size))
+        block_copy_wait();
+}
+
+void block_copy_print_stats(void)
+{
+#if IO_STATS
+    printf("block_copy:, DMA, %d, CPU, %d, ---, Cycles/512, memcpy, %d, DMA, %d, Start, %d,\n",
+        s_block_copy_dma_count, s_block_copy_cpu_count,
+        s_block_copy_memcpy_cycles, s_block_copy_dma_cycles, s_block_copy_start_cycles
+        );
+
+    //  At least memcpy minus DMA per copy, the caller still waits for the DMA to finish
+    uint32_t saved = s_block_copy_memcpy_cycles > s_block_copy_dma_cycles ?
+                     s_block_copy_memcpy_cycles - s_block_copy_dma_cycles : 0;
+    printf("block_copy:, Saved cycles/copy, %d, Saved ms, %d,\n",
+        saved, (uint32_t)((uint64_t)saved * s_block_copy_dma_count / (clock_get_hz(clk_sys) / 1000))
+        );
+#endif
+}
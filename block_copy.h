@@ -0,0 +1,45 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef _BLOCK_COPY_H
+#define _BLOCK_COPY_H
+
+#include <stddef.h>     //  For size_t
+#include <stdbool.h>    //  For bool
+
+
+extern void block_copy_init(void);
+
+//  Copy size bytes, returns true if a DMA copy is running and block_copy_wait() is needed
+extern bool block_copy_start(void *dst, const void *src, size_t size);
+
+extern void block_copy_wait(void);
+
+extern void block_copy(void *dst, const void *src, size_t size);
+
+extern void block_copy_print_stats(void);
+
+#endif //   _BLOCK_COPY_H
\ No newline at end of file
@@ -28,6 +28,16 @@ SOFTWARE.
 #include <pico/multicore.h>
 #include <a2pico.h>
 
+#if BUS_STATS
+#include <stdio.h>
+#include <hardware/clocks.h>
+#include <hardware/structs/systick.h>
+#endif
+#ifdef POWER_FAIL_PIN
+#include <hardware/gpio.h>
+#include <hardware/irq.h>
+#endif
+
 #include "sp.h"
 
 #include "board.h"
@@ -56,14 +66,51 @@ static volatile uint32_t self;
 static volatile uint32_t ser_command;
 static volatile uint32_t ser_control;
 
+static volatile uint32_t urgent_events;    //  Reset or power fail, core0 writes back its cache
+
 static volatile uint8_t ser_mask;
 static volatile uint8_t output_mask;
 
 volatile uint8_t sp_address_low = 0;
 volatile uint8_t sp_address_high = 0;
 
+#if BUS_STATS
+//  Bus responder timing, measured on core1 from a2pico_getaddr() returning
+//  to the end of the dispatch (i.e. after a2pico_putdata()) in SysTick cycles
+#define BUS_CLASS_ROM       0       //  $CN00 / $C800 firmware pages
+#define BUS_CLASS_PDMA      1       //  $CB00 compiled code page
+#define BUS_CLASS_DEVSEL    2       //  $C0N0 - $C0NF
+#define BUS_CLASS_CFFX      3       //  $CFF0 - $CFFF
+#define BUS_CLASSES         4
+
+#define BUS_HIST_SHIFT      3       //  8 cycles per histogram bucket
+#define BUS_HIST_SIZE       16      //  Last bucket collects everything above
+
+static const char *bus_class_names[BUS_CLASSES] = {"ROM", "PDMA", "DEVSEL", "CFFX"};
+
+static struct {
+    uint32_t count;
+    uint32_t worst;
+    uint32_t hist[BUS_HIST_SIZE];
+} bus_stats[BUS_CLASSES];
+
+static inline void __time_critical_func(bus_stats_record)(uint32_t class, uint32_t start) {
+    uint32_t cycles = (start - systick_hw->cvr) & 0x00FFFFFF;      //  SysTick counts down
+
+    bus_stats[class].count++;
+    if (cycles > bus_stats[class].worst) {
+        bus_stats[class].worst = cycles;
+    }
+    uint32_t bucket = cycles >> BUS_HIST_SHIFT;
+    if (bucket >= BUS_HIST_SIZE) {
+        bucket = BUS_HIST_SIZE - 1;
+    }
+    bus_stats[class].hist[bucket]++;
+}
+#endif
+
 volatile uint8_t *firmware_map[64];                      //  This is used to break the 16K firnmware region into 64 x 256 byte pages
-volatile uint8_t firmware_code_buffer[4096];             //  Buffer for code gen (smartport reads)
+volatile uint8_t firmware_code_buffer[SP_CODE_BUFFERS][SP_CODE_SIZE];    //  Buffers for code gen (smartport reads)
 
 static void __time_critical_func(reset)(bool asserted) {
     static absolute_time_t assert_time;
@@ -84,6 +131,7 @@ static void __time_critical_func(reset)(bool asserted) {
 
         multicore_fifo_drain();
         sp_reset();
+        urgent_events++;
 
         assert_time = get_absolute_time();
     } else {
@@ -171,7 +219,7 @@ static void __time_critical_func(sp_data_get)(void) {
     if (!active) {
         return;
     }
-    a2pico_putdata(pio0, sp_buffer[sp_read_offset]);
+    a2pico_putdata(pio0, sp_buffer[sp_read_offset & (SP_BUFFER_SIZE - 1)]);
     sp_read_offset++;
 }
 
@@ -239,7 +287,7 @@ static void __time_critical_func(sp_data_put)(uint32_t data) {
     if (!active) {
         return;
     }
-    sp_buffer[sp_write_offset++] = data;
+    sp_buffer[sp_write_offset++ & (SP_BUFFER_SIZE - 1)] = data;
 }
 
 static void __time_critical_func(sp_control_put)(uint32_t data) {
@@ -323,15 +371,45 @@ void __time_critical_func(build_firmware_map)(void) {
         firmware_map[i] = (uint8_t *)(&(firmware[i << 8]));
     }
 
-    firmware_code_buffer[0] = 0x60;  //  RTS
+    firmware_code_buffer[0][0] = 0x60;  //  RTS
 
-    firmware_map[SP_CODE_MAP1] = firmware_code_buffer;                    //  43 == 0xCB00 (bank 2)
-    firmware_map[SP_CODE_MAP2] = firmware_code_buffer;                    //  59 == 0xCB00 (bank 3)
+    firmware_map[SP_CODE_MAP1] = firmware_code_buffer[0];                 //  43 == 0xCB00 (bank 2)
+    firmware_map[SP_CODE_MAP2] = firmware_code_buffer[0];                 //  59 == 0xCB00 (bank 3)
+}
+
+#ifdef POWER_FAIL_PIN
+//  Optional early warning, e.g. a comparator on the 5V rail pulling the pin low. A raw
+//  handler, the one GPIO callback of the core belongs to the a2pico reset handler
+static void __time_critical_func(power_fail)(void) {
+    if (gpio_get_irq_event_mask(POWER_FAIL_PIN) & GPIO_IRQ_EDGE_FALL) {
+        gpio_acknowledge_irq(POWER_FAIL_PIN, GPIO_IRQ_EDGE_FALL);
+        urgent_events++;
+    }
+}
+#endif
+
+uint32_t board_urgent_events(void) {
+    return urgent_events;
 }
 
 void __time_critical_func(board)(void) {
     build_firmware_map();
 
+#ifdef POWER_FAIL_PIN
+    gpio_init(POWER_FAIL_PIN);
+    gpio_pull_up(POWER_FAIL_PIN);
+    gpio_add_raw_irq_handler(POWER_FAIL_PIN, &power_fail);
+    gpio_set_irq_enabled(POWER_FAIL_PIN, GPIO_IRQ_EDGE_FALL, true);
+    irq_set_enabled(IO_IRQ_BANK0, true);
+#endif
+
+#if BUS_STATS
+    //  SysTick is per core, free running from the processor clock
+    systick_hw->rvr = 0x00FFFFFF;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;      //  CLKSOURCE | ENABLE, no interrupt
+#endif
+
     a2pico_init(pio0);
 
     a2pico_resethandler(&reset);
@@ -343,11 +421,21 @@ void __time_critical_func(board)(void) {
         uint32_t strb = pico & 0x0800;      // IOSTRB
         uint32_t read = pico & 0x1000;      // R/W
 
+#if BUS_STATS
+        uint32_t start = systick_hw->cvr;
+#endif
+
         if (read) {
             if (addr >= 0x0FF0) {
                 cffx_get[addr & 0xF]();
+#if BUS_STATS
+                bus_stats_record(BUS_CLASS_CFFX, start);
+#endif
             } else if (!io) {
                 devsel_get[addr & 0xF]();
+#if BUS_STATS
+                bus_stats_record(BUS_CLASS_DEVSEL, start);
+#endif
             } else if (!strb || active) {
                 uint32_t fw_addr = offset | addr;
                 a2pico_putdata(pio0, firmware_map[(fw_addr & 0x3F00) >> 8][fw_addr & 0x00FF]);
@@ -356,6 +444,10 @@ void __time_critical_func(board)(void) {
                     firmware_map[SP_CODE_MAP1] += 256;    //  Move to the next page
                     firmware_map[SP_CODE_MAP2] += 256;    //  Move to the next page
                 }
+#if BUS_STATS
+                uint32_t page = (fw_addr & 0x3F00) >> 8;
+                bus_stats_record((page == SP_CODE_MAP1 || page == SP_CODE_MAP2) ? BUS_CLASS_PDMA : BUS_CLASS_ROM, start);
+#endif
             }
         } else {
             uint32_t data = a2pico_getdata(pio0);
@@ -376,3 +468,19 @@ void __time_critical_func(board)(void) {
 uint8_t board_slot(void) {
     return self >> 8;
 }
+
+void board_print_stats(void) {
+#if BUS_STATS
+    uint32_t mhz = clock_get_hz(clk_sys) / 1000000;
+
+    printf("board:, SysClk, %lu MHz,\n", mhz);
+    for (int class = 0; class < BUS_CLASSES; class++) {
+        printf("board:, %s, %lu, Worst, %lu cycles, %lu ns, Hist,", bus_class_names[class],
+            bus_stats[class].count, bus_stats[class].worst, bus_stats[class].worst * 1000 / mhz);
+        for (int bucket = 0; bucket < BUS_HIST_SIZE; bucket++) {
+            printf(" %lu,", bus_stats[class].hist[bucket]);
+        }
+        printf("\n");
+    }
+#endif
+}
@@ -30,7 +30,10 @@ SOFTWARE.
 #define SP_CODE_MAP1    (0x2B)  //  43
 #define SP_CODE_MAP2    (0x3B)  //  59
 
-extern volatile uint8_t firmware_code_buffer[];      //  Buffer for code gen (smartport reads)
+#define SP_CODE_SIZE    4096    //  A compiled block write needs 13 pages
+#define SP_CODE_BUFFERS 2       //  The next read is compiled while the 6502 runs the current one
+
+extern volatile uint8_t firmware_code_buffer[SP_CODE_BUFFERS][SP_CODE_SIZE];     //  Buffers for code gen (smartport reads)
 extern volatile uint8_t *firmware_map[];             //  This is used to break the 16K firnmware region into 64 x 256 byte pages
 extern volatile uint8_t sp_address_low;
 extern volatile uint8_t sp_address_high;
@@ -40,4 +43,8 @@ void board(void);
 
 uint8_t board_slot(void);
 
+uint32_t board_urgent_events(void);
+
+void board_print_stats(void);
+
 #endif
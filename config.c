@@ -33,6 +33,10 @@ SOFTWARE.
 
 #include "sp.h"
 #include "hdd.h"
+#include "thin.h"
+#if MEDIUM == USB
+#include "copy.h"
+#endif
 #include "diskio.h"
 #include "main.h"
 
@@ -40,7 +44,6 @@ SOFTWARE.
 
 #define DEFAULT_BOOTDELAY 3
 
-#define MAX_PATH    256
 #define MAX_DIR     256
 
 #define SECTION_NONE        0
@@ -60,12 +63,15 @@ SOFTWARE.
 
 #define CONFIG_QUIT 0
 #define CONFIG_CONT 1
+#define CONFIG_POLL 2   // Redraw again without waiting for a key
 
 #define COLS    40
 #define ROWS    24
 
 static uint8_t bootdelay;
 
+static bool adtpro;
+
 static struct {
     char path[MAX_PATH];
 } drives[MAX_DRIVES];
@@ -88,6 +94,7 @@ static void get_config(void) {
         return;
     }
     bootdelay = DEFAULT_BOOTDELAY;
+    adtpro = false;
     drives_number = MAX_DRIVES;
 
     FIL text;
@@ -131,6 +138,9 @@ static void get_config(void) {
                     }
                     bootdelay = line[10] - '0';
                 }
+                if (strncasecmp(line, "adtpro=", 7) == 0) {
+                    adtpro = line[7] == '1';
+                }
                 break;
             case SECTION_DRIVES:
                 if (strncasecmp(line, "number=", 7) == 0) {
@@ -154,6 +164,7 @@ static void get_config(void) {
 
     printf("[settings]\n");
     printf("bootdelay=%d\n", bootdelay);
+    printf("adtpro=%d\n", adtpro);
     printf("[drives]\n");
     printf("number=%d\n", drives_number);
     for (int drive = 0; drive < drives_number; drive++) {
@@ -172,8 +183,8 @@ static void put_config(void) {
         return;
     }
 
-    if(f_printf(&text, "[settings]\nbootdelay=%d\n[drives]\nnumber=%d\n",
-            bootdelay, drives_number) < 0) {
+    if(f_printf(&text, "[settings]\nbootdelay=%d\n%s[drives]\nnumber=%d\n",
+            bootdelay, adtpro ? "adtpro=1\n" : "", drives_number) < 0) {
         if (f_error(&text)) {
             printf("f_printf(A2retroNET.txt) error\n");
         }
@@ -202,6 +213,11 @@ uint8_t config_drives(void) {
     return drives_number;
 }
 
+bool config_adtpro(void) {
+    get_config();
+    return adtpro;
+}
+
 char *config_drivepath(uint8_t drive) {
     get_config();
     return drives[drive].path;
@@ -261,10 +277,17 @@ static void delay(uint8_t counter) {
 }
 
 static int get_key(void) {
+#if MEDIUM == USB
+    ack(copy_active() ? CONFIG_POLL : CONFIG_CONT);
+#else
     ack(CONFIG_CONT);
+#endif
 
     while (sp_control == CONTROL_DONE) {
         io_task();
+#if MEDIUM == USB
+        copy_task();
+#endif
     }
 
     if (sp_control != CONTROL_CONFIG) {
@@ -353,7 +376,7 @@ static bool settings(bool *put) {
 }
 
 static bool is_image(char *path) {
-    static const char *ext_list[] = {".po", ".hdv", ".2mg"};
+    static const char *ext_list[] = {".po", ".hdv", ".2mg", ".tpo"};
 
     char *ext = strrchr(path, '.');
     if (!ext) {
@@ -412,6 +435,23 @@ static void get_directory(char *path) {
     qsort(directory, directory_size, sizeof(directory[0]), directory_compare);
 }
 
+static bool new_image(char *dir, char *path) {
+    for (int n = 1; n < 100; n++) {
+        char new_path[MAX_PATH];
+        snprintf(new_path, sizeof(new_path), "%sNEW%d.TPO", dir, n);
+
+        FILINFO info;
+        if (f_stat(new_path, &info) == FR_NO_FILE) {
+            if (!hdd_create_thin(new_path, THIN_MAX_BLOCKS)) {
+                return false;
+            }
+            strcpy(path, new_path);
+            return true;
+        }
+    }
+    return false;
+}
+
 void config(void) {
     get_config();
 
@@ -459,6 +499,11 @@ void config(void) {
                 directory[start + e].fattrib & AM_DIR ? "%s/" : "%s", directory[start + e].fname);
         }
         hline(ROWS - 2);
+#if MEDIUM == USB
+        if (copy_status()[0]) {
+            printfxy(0, ROWS - 2, false, "%s", copy_status());
+        }
+#endif
 
         // 0123456789012345678901234567890123456789
         // Esc     Space       Return       -
@@ -574,6 +619,33 @@ void config(void) {
                 drives[drive].path[0] = '\0';
                 put = true;
                 break;
+            case 23:    // Ctrl-W
+                hdd_swap(drive, HDD_SWAP_NEXT);     // disk sets only, nothing is written back
+                break;
+            case 4:     // Ctrl-D
+                hdd_dump_hot(drive);
+                break;
+#if MEDIUM == USB
+            case 3:     // Ctrl-C
+                if (copy_active()) {
+                    copy_cancel();
+                } else if (hdd_usb_mounted() && hdd_sd_mounted() &&
+                           directory_size && !(directory[start + entry].fattrib & AM_DIR)) {
+                    char path[MAX_PATH];
+                    strcpy(path, dir);
+                    strcat(path, directory[start + entry].fname);
+                    copy_start(path, dir[0] == 'S' ? "USB:/" : "SD:/");
+                }
+                break;
+#endif
+            case 14:    // Ctrl-N
+                if (new_image(dir, drives[drive].path)) {
+                    get_directory(dir);
+                    start = 0;
+                    entry = 0;
+                    put = true;
+                }
+                break;
         }        
     }
 
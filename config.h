@@ -28,6 +28,7 @@ SOFTWARE.
 #define _CONFIG_H
 
 #define MAX_DRIVES 8
+#define MAX_PATH   256
 
 void config_reset(void);
 
@@ -35,6 +36,8 @@ uint8_t config_drives(void);
 
 char *config_drivepath(uint8_t drive);
 
+bool config_adtpro(void);
+
 void config(void);
 
 #endif
@@ -0,0 +1,198 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#include <string.h>
+#include <stdio.h>
+#include <pico/stdlib.h>
+#include <f_util.h>
+
+#include "config.h"
+
+#include "copy.h"
+
+#define COPY_CHUNK      (16 * 512)      //  Per idle step, multi-sector reads and writes bypass the block cache
+#define COPY_BACKOFF_US 250000          //  Pause after every Apple II command
+
+#define TWOMG_HEADER    0x40
+
+static struct {
+    bool     active;
+    FIL      src;
+    FIL      dst;
+    char     dst_path[MAX_PATH];
+    char     name[32];
+    FSIZE_t  size;
+    FSIZE_t  done;
+    uint32_t resume;
+    char     status[41];
+} copy;
+
+static uint8_t buffer[COPY_CHUNK] __attribute__((aligned(4)));
+
+static uint32_t get32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void finish(bool ok) {
+    f_close(&copy.src);
+    FRESULT fr = f_close(&copy.dst);
+    if (ok && fr != FR_OK) {
+        printf("f_close(%s) error: %s (%d)\n", copy.dst_path, FRESULT_str(fr), fr);
+        ok = false;
+    }
+    if (!ok) {
+        f_unlink(copy.dst_path);
+    }
+    copy.active = false;
+
+    printf("Copy %s(%s)\n", ok ? "Done" : "Failed", copy.dst_path);
+    snprintf(copy.status, sizeof(copy.status), "%s %s", copy.name, ok ? "copied" : "copy failed");
+}
+
+//  Copy the image at path into dir, a .2mg image becomes a .po image
+bool copy_start(const char *path, const char *dir) {
+    if (copy.active) {
+        return false;
+    }
+
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    strncpy(copy.name, name, sizeof(copy.name) - 1);
+    copy.name[sizeof(copy.name) - 1] = '\0';
+
+    FRESULT fr = f_open(&copy.src, path, FA_OPEN_EXISTING | FA_READ);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    FSIZE_t offset = 0;
+    copy.size = f_size(&copy.src);
+
+    snprintf(copy.dst_path, sizeof(copy.dst_path), "%s%s", dir, name);
+    char *extension = strrchr(copy.dst_path, '.');
+    if (extension && strcasecmp(extension, ".2mg") == 0) {
+        UINT br;
+        fr = f_read(&copy.src, buffer, TWOMG_HEADER, &br);
+        if (fr != FR_OK || br != TWOMG_HEADER || memcmp(buffer, "2IMG", 4)) {
+            printf("  Bad 2MG Header\n");
+            f_close(&copy.src);
+            return false;
+        }
+        //  Only ProDOS order data is a .po image
+        if (get32(&buffer[0x0C]) != 1) {
+            printf("  Not ProDOS Order 2MG\n");
+            f_close(&copy.src);
+            return false;
+        }
+        offset = get32(&buffer[0x18]);      //  Image data offset
+        copy.size = get32(&buffer[0x1C]);   //  Image data length
+        if (!copy.size) {
+            copy.size = (FSIZE_t)get32(&buffer[0x14]) * 512;     //  Left out by some tools, the block count has it
+        }
+        if (offset + copy.size > f_size(&copy.src)) {
+            printf("  Bad 2MG Header\n");
+            f_close(&copy.src);
+            return false;
+        }
+        strcpy(extension, ".po");
+    }
+
+    fr = f_lseek(&copy.src, offset);
+    if (fr != FR_OK) {
+        printf("f_lseek(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        f_close(&copy.src);
+        return false;
+    }
+
+    fr = f_open(&copy.dst, copy.dst_path, FA_CREATE_NEW | FA_WRITE);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", copy.dst_path, FRESULT_str(fr), fr);
+        f_close(&copy.src);
+        return false;
+    }
+
+    printf("Copy Start(%s,%s)\n", path, copy.dst_path);
+
+    copy.done = 0;
+    copy.resume = time_us_32();
+    copy.active = true;
+    return true;
+}
+
+void copy_cancel(void) {
+    if (copy.active) {
+        finish(false);
+        snprintf(copy.status, sizeof(copy.status), "%s copy canceled", copy.name);
+    }
+}
+
+bool copy_active(void) {
+    return copy.active;
+}
+
+const char *copy_status(void) {
+    if (copy.active) {
+        snprintf(copy.status, sizeof(copy.status), "%s %d%%", copy.name,
+            copy.size ? (int)(copy.done * 100 / copy.size) : 0);
+    }
+    return copy.status;
+}
+
+void copy_throttle(void) {
+    copy.resume = time_us_32() + COPY_BACKOFF_US;
+}
+
+bool copy_task(void) {
+    if (!copy.active || (int32_t)(time_us_32() - copy.resume) < 0) {
+        return false;
+    }
+
+    UINT size = copy.size - copy.done > COPY_CHUNK ? COPY_CHUNK : copy.size - copy.done;
+
+    UINT br;
+    FRESULT fr = f_read(&copy.src, buffer, size, &br);
+    if (fr != FR_OK || br != size) {
+        printf("f_read(%s) error: %s (%d)\n", copy.name, FRESULT_str(fr), fr);
+        finish(false);
+        return true;
+    }
+
+    UINT bw;
+    fr = f_write(&copy.dst, buffer, size, &bw);
+    if (fr != FR_OK || bw != size) {
+        printf("f_write(%s) error: %s (%d)\n", copy.dst_path, FRESULT_str(fr), fr);
+        finish(false);
+        return true;
+    }
+
+    copy.done += size;
+    if (copy.done == copy.size) {
+        finish(true);
+    }
+
+    return true;
+}
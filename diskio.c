@@ -11,14 +11,16 @@
 #include <diskio.h>     // Declarations of disk functions
 #include <glue.h>       // Declarations of SD card functions
 #include "usb_diskio.h" // Declarations of USB MSD functions
+#include "write_log.h"  // Staging of SD card writes
 #include <stddef.h>
 #include <stdbool.h>    //  For bool
 
 #define USE_BLOCK_CACHE             1
-#define USE_BLOCK_CACHE_READ_AHEAD  1       //  USE_BLOCK_CACHE must be 1 to use
+#define USE_BLOCK_CACHE_READ_AHEAD  0       //  USE_BLOCK_CACHE must be 1 to use, hdd.c reads ahead in the image
 
 #if USE_BLOCK_CACHE
 #include "block_cache.h"
+#include "block_copy.h"
 
 bool block_cache_initalized = false;
 #endif
@@ -44,7 +46,7 @@ void disk_init(void) {
 #endif
 }
 
-void disk_task(void) {
+int disk_task(void) {
     bool more_work = true;              //  We want to limit the amount of work done here
 
 #if USE_BLOCK_CACHE
@@ -59,11 +61,17 @@ void disk_task(void) {
     }
 #endif
 
-    if (more_work == true) {
+    if ((more_work == true) && block_cache_dirty()) {
         block_cache_flush(false, false);       //  If we have time, flush one block from the cache
         more_work = false;
     }
 #endif
+
+    if ((more_work == true) && write_log_task()) {
+        more_work = false;                     //  Merged a batch of logged sectors home
+    }
+
+    return !more_work;
 }
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
@@ -101,8 +109,14 @@ DSTATUS disk_initialize(
 #endif
 
     switch (pdrv) {
-        case DEV_SD:
-            return sd_disk_initialize(DEV_SD);
+        case DEV_SD: {
+            DSTATUS status = sd_disk_initialize(DEV_SD);
+#if USE_BLOCK_CACHE
+            //  The SD driver's DMA channels are required, the block cache's one is not
+            block_copy_init();
+#endif
+            return status;
+        }
 
 #if MEDIUM == USB
             case DEV_USB:
@@ -132,8 +146,10 @@ DRESULT disk_read(
         result = block_cache_read_block(pdrv, sector, buff);
     }
     else {
-        block_cache_flush(true, true);
-        result = disk_read_no_cache(pdrv, buff, sector, count);
+        //  Multi-sector reads bypass the cache, it only has to be written back
+        result = block_cache_sync_range(pdrv, sector, count, false);
+        if (result == RES_OK)
+            result = disk_read_no_cache(pdrv, buff, sector, count);
     }
 #else
     result = disk_read_no_cache(pdrv, buff, sector, count);
@@ -143,7 +159,7 @@ DRESULT disk_read(
     if (result == RES_OK) {
         read_ahead = true;
         last_pdrv = pdrv;
-        last_sector = sector;
+        last_sector = sector + count - 1;    //  Continue after a multi-sector read
     }
 #endif
 
@@ -157,8 +173,13 @@ DRESULT disk_read_no_cache(
     UINT count      // Number of sectors to read
 ) {
     switch (pdrv) {
-        case DEV_SD:
-            return sd_disk_read(DEV_SD, buff, sector, count);
+        case DEV_SD: {
+            //  Sectors still in the write log are newer than their home copy
+            DRESULT result = sd_disk_read(DEV_SD, buff, sector, count);
+            if (result == RES_OK)
+                result = write_log_patch(DEV_SD, buff, sector, count);
+            return result;
+        }
 
 #if MEDIUM == USB
             case DEV_USB:
@@ -190,8 +211,10 @@ DRESULT disk_write(
         result = block_cache_write_block(pdrv, sector, buff);
     }
     else {
-        block_cache_flush(true, true);
-        result = disk_write_no_cache(pdrv, buff, sector, count);
+        //  Multi-sector writes bypass the cache, drop the stale copies
+        result = block_cache_sync_range(pdrv, sector, count, true);
+        if (result == RES_OK)
+            result = disk_write_no_cache(pdrv, buff, sector, count);
     }
 #else
     result = disk_write_no_cache(pdrv, buff, sector, count);
@@ -207,8 +230,12 @@ DRESULT disk_write_no_cache(
     UINT count          // Number of sectors to write
 ) {
     switch (pdrv) {
-        case DEV_SD:
+        case DEV_SD: {
+            DRESULT result = write_log_before_write(DEV_SD, sector, count);
+            if (result != RES_OK)
+                return result;
             return sd_disk_write(DEV_SD, buff, sector, count);
+        }
 
 #if MEDIUM == USB
             case DEV_USB:
@@ -232,9 +259,13 @@ DRESULT disk_ioctl(
     BYTE cmd,   // Control code
     void *buff  // Buffer to send/receive control data
 ) {
-#if USE_BLOCK_CACHE    
-    //  Make sure the cache is flushed (ignores errors???)
-    block_cache_flush(true, true);
+#if USE_BLOCK_CACHE
+    //  Only the commands that reach the medium need the cache, size queries don't
+    if (cmd == CTRL_SYNC) {
+        DRESULT result = block_cache_flush(true, false);
+        if (result != RES_OK)
+            return result;
+    }
 #endif
 
     switch (pdrv) {
@@ -253,4 +284,12 @@ DRESULT disk_ioctl(
 
 DRESULT disk_flush(void){
     return block_cache_flush(true, true);       //  Flush and invalidate the cache
+}
+
+DRESULT disk_flush_urgent(void){
+#if USE_BLOCK_CACHE
+    return block_cache_flush_urgent();
+#else
+    return RES_OK;
+#endif
 }
\ No newline at end of file
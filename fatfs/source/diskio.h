@@ -28,7 +28,7 @@ typedef enum {
 /* Prototypes for disk control functions */
 
 void disk_init(void);
-void disk_task(void);
+int disk_task(void);		/* Returns 0 if there was nothing to do */
 
 DSTATUS disk_initialize (BYTE pdrv);
 DSTATUS disk_status (BYTE pdrv);
@@ -38,6 +38,7 @@ DRESULT disk_read_no_cache (BYTE pdrv, BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_write_no_cache (BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 DRESULT disk_flush(void);
+DRESULT disk_flush_urgent(void);	/* Everything now, keeps the cache */
 
 
 
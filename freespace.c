@@ -0,0 +1,213 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+//  FatFs looks for a free cluster starting at fs->last_clst. Right after the
+//  mount that is the start of the volume, and on a big, well used card the
+//  linear search can read thousands of FAT or bitmap sectors before it finds
+//  one. We scan the allocation state a sector at a time in idle time, remember
+//  the largest free runs and keep last_clst parked just before one of them, so
+//  new clusters are found with the first FAT access. last_clst is only a hint,
+//  a stale run never causes a wrong allocation.
+
+#include "freespace.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <diskio.h>
+
+#define FREE_RUNS       8       //  Largest free runs remembered per volume
+#define FREE_RUN_MIN    16      //  Clusters, smaller runs aren't worth remembering
+
+typedef struct {
+    DWORD start;
+    DWORD length;
+} free_run;
+
+static struct {
+    FATFS   *fs;
+    WORD     id;                //  Mount ID the scan belongs to
+    bool     done;
+    LBA_t    sector;            //  Next sector to scan, relative to the FAT or bitmap
+    DWORD    cluster;           //  First cluster described by that sector
+    DWORD    run_start;         //  Free run the scan is in, length 0 if none
+    DWORD    run_length;
+    DWORD    free;              //  Free clusters seen by the scan
+    free_run runs[FREE_RUNS];
+    uint32_t hints;
+} volumes[FF_VOLUMES];
+
+static BYTE scratch[FF_MAX_SS];
+
+void freespace_mount(FATFS *fs) {
+    for (int v = 0; v < FF_VOLUMES; v++) {
+        if (volumes[v].fs == fs || !volumes[v].fs) {
+            memset(&volumes[v], 0, sizeof(volumes[v]));
+            volumes[v].fs = fs;
+            volumes[v].id = fs->id;
+            volumes[v].cluster = fs->fs_type == FS_EXFAT ? 2 : 0;
+            return;
+        }
+    }
+}
+
+//  Keep the run if it is one of the largest
+static void remember_run(int v, DWORD start, DWORD length) {
+    if (length < FREE_RUN_MIN) {
+        return;
+    }
+
+    free_run *smallest = &volumes[v].runs[0];
+    for (int r = 1; r < FREE_RUNS; r++) {
+        if (volumes[v].runs[r].length < smallest->length) {
+            smallest = &volumes[v].runs[r];
+        }
+    }
+    if (length > smallest->length) {
+        smallest->start = start;
+        smallest->length = length;
+    }
+}
+
+static void scan_cluster(int v, DWORD cluster, bool free) {
+    if (free) {
+        if (!volumes[v].run_length) {
+            volumes[v].run_start = cluster;
+        }
+        volumes[v].run_length++;
+        volumes[v].free++;
+    } else if (volumes[v].run_length) {
+        remember_run(v, volumes[v].run_start, volumes[v].run_length);
+        volumes[v].run_length = 0;
+    }
+}
+
+//  Scan the next sector of the FAT (FAT16/32) or allocation bitmap (exFAT)
+static void scan_sector(int v) {
+    FATFS *fs = volumes[v].fs;
+    DWORD per_sector;
+    LBA_t base;
+
+    switch (fs->fs_type) {
+        case FS_FAT16: per_sector = FF_MAX_SS / 2; base = fs->fatbase; break;
+        case FS_FAT32: per_sector = FF_MAX_SS / 4; base = fs->fatbase; break;
+        case FS_EXFAT: per_sector = FF_MAX_SS * 8; base = fs->bitbase; break;
+        default:
+            //  FAT12 volumes are too small to matter
+            volumes[v].done = true;
+            return;
+    }
+
+    //  A failed read just ends the scan, the runs found so far are still good hints
+    if (disk_read_no_cache(fs->pdrv, scratch, base + volumes[v].sector, 1) != RES_OK) {
+        printf("freespace: read error at sector %lu\n", (uint32_t)(base + volumes[v].sector));
+        volumes[v].done = true;
+        return;
+    }
+
+    DWORD cluster = volumes[v].cluster;
+    for (DWORD i = 0; i < per_sector && cluster < fs->n_fatent; i++, cluster++) {
+        bool free;
+        switch (fs->fs_type) {
+            case FS_FAT16: free = !(scratch[i * 2] | scratch[i * 2 + 1]); break;
+            case FS_FAT32: free = !(scratch[i * 4] | scratch[i * 4 + 1] | scratch[i * 4 + 2] | (scratch[i * 4 + 3] & 0x0F)); break;
+            default:       free = !(scratch[i / 8] & (1 << (i % 8))); break;
+        }
+        //  FAT entries 0 and 1 are reserved
+        if (cluster >= 2) {
+            scan_cluster(v, cluster, free);
+        }
+    }
+    volumes[v].cluster = cluster;
+    volumes[v].sector++;
+
+    if (cluster >= fs->n_fatent) {
+        scan_cluster(v, cluster, false);    //  Close the last run
+        volumes[v].done = true;
+        printf("freespace: %lu free clusters\n", volumes[v].free);
+    }
+}
+
+//  Park fs->last_clst in front of the largest run FatFs hasn't used up yet
+static void place_hint(int v) {
+    FATFS *fs = volumes[v].fs;
+    DWORD next = fs->last_clst + 1;
+
+    free_run *best = NULL;
+    for (int r = 0; r < FREE_RUNS; r++) {
+        free_run *run = &volumes[v].runs[r];
+        if (!run->length) {
+            continue;
+        }
+        //  FatFs allocated from this run, the used part is gone
+        if (fs->last_clst < fs->n_fatent && next > run->start && next <= run->start + run->length) {
+            run->length -= next - run->start;
+            run->start = next;
+        }
+        if (run->length && next >= run->start && next < run->start + run->length) {
+            return;                         //  Already in a free run
+        }
+        if (!best || run->length > best->length) {
+            best = run;
+        }
+    }
+
+    if (best && best->length) {
+        fs->last_clst = best->start - 1;
+        volumes[v].hints++;
+    }
+}
+
+bool freespace_task(void) {
+    for (int v = 0; v < FF_VOLUMES; v++) {
+        FATFS *fs = volumes[v].fs;
+        if (!fs || !fs->fs_type) {
+            continue;
+        }
+        if (fs->id != volumes[v].id) {
+            freespace_mount(fs);            //  Remounted, start over
+        }
+
+        place_hint(v);
+
+        if (!volumes[v].done) {
+            scan_sector(v);
+            return true;
+        }
+    }
+    return false;
+}
+
+void freespace_print_stats(void) {
+#if IO_STATS
+    for (int v = 0; v < FF_VOLUMES; v++) {
+        if (!volumes[v].fs) {
+            continue;
+        }
+        printf("freespace:, Volume, %d, Free, %lu, Done, %d, Hints, %lu,\n",
+            v, volumes[v].free, volumes[v].done, volumes[v].hints);
+    }
+#endif
+}
@@ -26,6 +26,9 @@ SOFTWARE.
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pico/stdlib.h>
 #include <rtc.h>
 #include <f_util.h>
 #include <hw_config.h>
@@ -35,12 +38,71 @@ SOFTWARE.
 
 #include "hdd.h"
 #include "diskio.h"
+#include "block_cache.h"
+#include "thin.h"
+#include "hot.h"
+#include "freespace.h"
+#include "write_log.h"
+#include "vdir.h"
 
 #define BLOCK_SIZE  512
+#define ENTRY_SIZE  32          //  FAT directory entry
+
+#define USE_BLOCK_PREFETCH  1       //  Learn which block follows which and prefetch it when idle
+
+#if USE_BLOCK_PREFETCH
+#define PREFETCH_ENTRIES    128     //  Successor table entries per drive, power of 2
+#define PREFETCH_WAYS       2       //  Successors remembered per block
+#define PREFETCH_CONF_MAX   7
+#define PREFETCH_CONF_MIN   3       //  Confidence needed to issue a prefetch
+#define PREFETCH_RECENT     8       //  Issued prefetches waiting to be used
+#define PREFETCH_WINDOW     64      //  Issued prefetches between accuracy checks
+#define PREFETCH_ACCURACY   4       //  Disable the drive below 1 in 4 used
+#endif
+
+#define USE_MIRROR  (MEDIUM == USB) //  Keep mirror:/ images on SD: and USB: and read from the faster one
+
+#if USE_MIRROR
+#define MIRROR_PREFIX   "mirror:"
+#define MIRROR_REGIONS  16          //  Block ranges with their own latency estimate
+#define MIRROR_PROBE    16          //  Every nth read of a region goes to the slower side
+#define MIRROR_CHECK    4           //  Blocks compared per idle call
+#endif
+
+#define USE_DISK_SETS   1           //  Keep all images of a set:/dir/*.po drive open for instant swaps
+
+#if USE_DISK_SETS
+#define SET_PREFIX      "set:"
+#define SET_MEMBERS     8
+#define SET_LINKMAP     32          //  Fast seek table DWORDs per member, 15 fragments
+#define SET_WARM        8           //  Blocks read into the cache on open, boot and volume directory
+#endif
+
+#define USE_VIRTUAL_DIR 1           //  Show the files of a dir:/path directory as a read-only volume
+
+#if USE_VIRTUAL_DIR
+#define VDIR_PREFIX     "dir:"
+#endif
+
+#define USE_HOT_BLOCKS  1           //  Count accesses per group of blocks, dumped to <image>.hot
+
+#if USE_HOT_BLOCKS
+#define HOT_COUNTERS    4096        //  4 bits each, a 32MB volume gets one per 16 blocks
+#define HOT_MAX         15
+#endif
+
+#define USE_READ_BATCH  1           //  Read the rest of a sequential run with one f_read()
+
+#define USE_READ_AHEAD  1           //  USE_READ_BATCH must be 1 to use
+
+#if USE_READ_BATCH
+#define READ_BATCH_BLOCKS   8
+#endif
 
 #define SUCCESS     0x00
 #define IO_ERROR    0x27
 #define WRITE_PROT  0x2B
+#define DISK_SWITCHED 0x2E
 
 static bool sd, usb;
 
@@ -50,34 +112,773 @@ static struct {
     uint16_t blocks;
     bool     error;
     bool     prot;
+    bool     parked;                //  Kept open over hdd_reset()
+    bool     thin;
+    bool     vdir;                  //  Synthesized by vdir.c, no image
+    bool     switched;              //  Disk set swapped, not reported to the host yet
+    bool     map_valid;
+    uint16_t map_sector;            //  Block map sector in map
+    uint16_t map[BLOCK_SIZE / 2];
+    uint32_t data_offset;
+    char     path[MAX_PATH];
+    BYTE     entry[ENTRY_SIZE];     //  Directory entry when parked
 } hdd[MAX_DRIVES];
 
-static uint16_t get_blocks(int drive) {
-    if (!hdd[drive].error && !f_size(&hdd[drive].image)) {
-        char *path = config_drivepath(drive);
+static uint32_t generation[MAX_DRIVES];    //  Bumped whenever a drive's content may change
 
-        printf("HDD Open(Drive=%d,File=%s)\n", drive, path);
+static uint32_t writes_same;        //  Identical to the cached copy, no write, no sync
 
-        FRESULT fr = f_open(&hdd[drive].image, path, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
-        if (fr == FR_DENIED) {
-            printf("  Write-Protected\n");
-            fr = f_open(&hdd[drive].image, path, FA_OPEN_EXISTING | FA_READ);
-            hdd[drive].prot = true;
+#if USE_HOT_BLOCKS
+static struct {
+    uint32_t id;                    //  Hash of the drive path the counts belong to
+    uint32_t accesses;
+    uint32_t halvings;
+    uint8_t  count[HOT_COUNTERS / 2];
+} hot[MAX_DRIVES];
+#endif
+
+#if USE_MIRROR
+static struct {
+    FIL      image;                 //  USB: copy, hdd[].image is the SD: copy
+    bool     active;
+    bool     verified;              //  Every block compared, reads may use both copies
+    uint32_t checked;               //  Blocks compared so far
+    uint32_t latency[2][MIRROR_REGIONS];   //  Average read time in us, SD: and USB:
+    uint8_t  count[MIRROR_REGIONS];
+    uint32_t reads[2];
+} mirror[MAX_DRIVES];
+#endif
+
+#if USE_DISK_SETS
+static struct {
+    int      drive;                 //  -1 if no set is open
+    int      count;
+    int      current;               //  Member in hdd[].image, its slot here is stale
+    FIL      member[SET_MEMBERS];
+    bool     prot[SET_MEMBERS];
+    char     path[SET_MEMBERS][MAX_PATH];
+    DWORD    linkmap[SET_MEMBERS][SET_LINKMAP];
+    BYTE     entry[SET_MEMBERS][ENTRY_SIZE];    //  Directory entries when parked
+} set = { .drive = -1 };
+#endif
+
+#if USE_READ_BATCH
+static struct {
+    int      drive;                 //  -1 if empty
+    uint16_t block;
+    uint8_t  count;
+    uint32_t generation;            //  Of the drive when read
+    int      last_drive;
+    uint16_t last_block;
+    uint32_t reads;
+    uint32_t hits;
+    bool     refill;                //  The host reached the end, read the next run when idle
+    bool     ahead;                 //  Read ahead and not used yet
+    uint8_t  data[READ_BATCH_BLOCKS * BLOCK_SIZE];
+} batch = { .drive = -1, .last_drive = -1 };
+#endif
+
+#if USE_READ_BATCH && USE_READ_AHEAD
+static struct {
+    uint32_t issued;
+    uint32_t hits;
+    uint32_t wasted;                //  Replaced before the host got to it
+} ahead[MAX_DRIVES];
+#endif
+
+#if USE_BLOCK_PREFETCH
+static struct successor {
+    uint16_t block;
+    uint16_t next[PREFETCH_WAYS];
+    uint8_t  conf[PREFETCH_WAYS];
+} successor[MAX_DRIVES][PREFETCH_ENTRIES];
+
+static struct {
+    uint32_t id;                    //  Hash of the drive path the successors belong to
+    uint16_t last;
+    bool     last_valid;
+    bool     disabled;
+    uint16_t recent[PREFETCH_RECENT];
+    uint8_t  recent_valid;          //  Bit per recent entry
+    uint8_t  recent_next;
+    uint16_t window_issued;
+    uint16_t window_hits;
+    uint32_t issued;
+    uint32_t hits;
+    uint32_t wasted;
+} prefetch[MAX_DRIVES];
+
+static int      prefetch_drive = -1;    //  Pending prefetch, -1 if none
+static uint16_t prefetch_block;
+#endif
+
+static bool seek_file(int drive, FIL *fp, FSIZE_t position) {
+    FRESULT fr = f_lseek(fp, position);
+    if (fr != FR_OK) {
+        printf("f_lseek(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    return true;
+}
+
+static bool seek_position(int drive, FSIZE_t position) {
+    return seek_file(drive, &hdd[drive].image, position);
+}
+
+//  Returns the data slot of a thin image block, 0 if never written, -1 on error
+static int32_t thin_slot(int drive, uint16_t block) {
+    uint16_t sector = block / (BLOCK_SIZE / 2);
+
+    if (!hdd[drive].map_valid || hdd[drive].map_sector != sector) {
+        if (!seek_position(drive, THIN_HEADER_SIZE + sector * BLOCK_SIZE)) {
+            return -1;
         }
-        if (fr != FR_OK) {
-            printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
-            hdd[drive].error = true;
+
+        UINT br;
+        FRESULT fr = f_read(&hdd[drive].image, hdd[drive].map, BLOCK_SIZE, &br);
+        if (fr != FR_OK || br != BLOCK_SIZE) {
+            printf("f_read(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+            hdd[drive].map_valid = false;
+            return -1;
+        }
+        hdd[drive].map_sector = sector;
+        hdd[drive].map_valid = true;
+    }
+
+    return hdd[drive].map[block % (BLOCK_SIZE / 2)];
+}
+
+static bool thin_set_slot(int drive, uint16_t block, uint16_t slot) {
+    if (!seek_position(drive, THIN_HEADER_SIZE + block * sizeof(uint16_t))) {
+        return false;
+    }
+
+    UINT bw;
+    FRESULT fr = f_write(&hdd[drive].image, &slot, sizeof(slot), &bw);
+    if (fr != FR_OK || bw != sizeof(slot)) {
+        printf("f_write(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    if (hdd[drive].map_valid && hdd[drive].map_sector == block / (BLOCK_SIZE / 2)) {
+        hdd[drive].map[block % (BLOCK_SIZE / 2)] = slot;
+    }
+
+    return true;
+}
+
+static uint16_t thin_open(int drive) {
+    hdd[drive].thin = false;
+    hdd[drive].map_valid = false;
+
+    if (hdd[drive].error || !seek_position(drive, 0)) {
+        return 0;
+    }
+
+    thin_header header;
+    UINT br;
+    FRESULT fr = f_read(&hdd[drive].image, &header, sizeof(header), &br);
+    if (fr != FR_OK || br != sizeof(header) ||
+        memcmp(header.magic, THIN_MAGIC, sizeof(header.magic)) || header.version != THIN_VERSION ||
+        header.data_offset < THIN_HEADER_SIZE + THIN_MAP_SIZE(header.blocks) ||
+        f_size(&hdd[drive].image) < header.data_offset) {
+        printf("  Bad Thin Image\n");
+        return 0;
+    }
+
+    hdd[drive].thin = true;
+    hdd[drive].data_offset = header.data_offset;
+    printf("  Thin\n");
+
+    return header.blocks;
+}
+
+//  Sector at the aligned file position if FatFs knows it without a FAT lookup, else 0
+static LBA_t file_sector(FIL *fp) {
+    FATFS *fs = fp->obj.fs;
+    FSIZE_t in_cluster = fp->fptr % ((FSIZE_t)fs->csize * BLOCK_SIZE);
+
+    //  On a cluster boundary fp->clust is still the previous cluster
+    if (fp->fptr % BLOCK_SIZE || !in_cluster || fp->clust < 2 || fp->clust >= fs->n_fatent) {
+        return 0;
+    }
+    return fs->database + (LBA_t)fs->csize * (fp->clust - 2) + in_cluster / BLOCK_SIZE;
+}
+
+//  A write of what the card already has, going by the block cache
+static bool is_unchanged(int drive, const uint8_t *data) {
+    FIL *fp = &hdd[drive].image;
+    LBA_t sector = file_sector(fp);
+
+    return sector && block_cache_compare(fp->obj.fs->pdrv, sector, data) == 1;
+}
+
+static bool is_zero(const uint8_t *data) {
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//  exFAT file and stream extension entries, offsets from the start of the set as in ff.c
+#define XDIR_FILE       0x85
+#define XDIR_STREAM     0xC0
+#define XDIR_NUMSEC     1
+#define XDIR_SETSUM     2       //  Covers the whole set, names and valid size too, then attributes
+#define XDIR_TIMES      8       //  Created, modified, accessed and their extras
+#define XDIR_FSTCLUS    52
+#define XDIR_FILESIZE   56
+
+//  Read the directory entry of an open image, bypassing the FatFs window
+static bool read_entry(FIL *fp, BYTE *entry) {
+    FATFS *fs = fp->obj.fs;
+    static BYTE sector[2 * FF_MAX_SS];      //  The one before the recorded one, then that
+
+    if (disk_read(fs->pdrv, &sector[FF_MAX_SS], fp->dir_sect, 1) != RES_OK) {
+        return false;
+    }
+    UINT last = FF_MAX_SS + (fp->dir_ptr - fs->win);
+
+    if (fs->fs_type != FS_EXFAT) {
+        memcpy(entry, &sector[last], ENTRY_SIZE);
+        return true;
+    }
+
+    //  FatFs records the last entry of the set, its file entry may be in the
+    //  sector before, unless that belongs to another cluster
+    UINT first = FF_MAX_SS + fp->obj.c_ofs % FF_MAX_SS;
+    if (first > last) {
+        if ((fp->dir_sect - fs->database) % fs->csize == 0 ||
+            disk_read(fs->pdrv, sector, fp->dir_sect - 1, 1) != RES_OK) {
+            return false;
+        }
+        first -= FF_MAX_SS;
+    }
+    const BYTE *file = &sector[first];
+    const BYTE *stream = file + ENTRY_SIZE;
+    if (file[0] != XDIR_FILE || stream[0] != XDIR_STREAM ||
+        (last - first) / ENTRY_SIZE != file[XDIR_NUMSEC]) {
+        return false;
+    }
+
+    //  Compared like the FAT entry: set checksum, attributes and times, then
+    //  first cluster and size
+    memcpy(&entry[0], &file[XDIR_SETSUM], 4);
+    memcpy(&entry[4], &file[XDIR_TIMES], 16);
+    memcpy(&entry[20], &stream[XDIR_FSTCLUS - ENTRY_SIZE], 4);
+    memcpy(&entry[24], &stream[XDIR_FILESIZE - ENTRY_SIZE], 8);
+    return true;
+}
+
+//  Reuse a parked image if the path, the volume and the directory entry are unchanged
+static bool unpark(int drive, const char *path) {
+    FIL *fp = &hdd[drive].image;
+
+    hdd[drive].parked = false;
+
+    if (!strcmp(hdd[drive].path, path) && fp->obj.fs->fs_type && fp->obj.fs->id == fp->obj.id) {
+        BYTE entry[ENTRY_SIZE];
+        if (read_entry(fp, entry) && !memcmp(entry, hdd[drive].entry, ENTRY_SIZE)) {
+            fp->fptr = 0;
+            fp->sect = 0;           //  Drop the buffered sector
+            return true;
+        }
+    }
+
+    printf("HDD Close(Drive=%d)\n", drive);
+    f_close(fp);                    //  Synced when parked, fails if the volume is gone
+    memset(fp, 0, sizeof(FIL));
+    hdd[drive].prot = false;
+    return false;
+}
+
+#if USE_MIRROR
+//  The SD: copy of a mirror:/ image is opened as the drive image
+static const char *open_path(const char *path, char *buffer) {
+    if (strncasecmp(path, MIRROR_PREFIX, strlen(MIRROR_PREFIX))) {
+        return path;
+    }
+    snprintf(buffer, MAX_PATH, "SD:%s", path + strlen(MIRROR_PREFIX));
+    return buffer;
+}
+
+static void mirror_close(int drive) {
+    if (!mirror[drive].active) {
+        return;
+    }
+    mirror[drive].active = false;
+    mirror[drive].verified = false;
+
+    FRESULT fr = f_close(&mirror[drive].image);
+    if (fr != FR_OK) {
+        printf("f_close(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+    }
+}
+
+//  Both copies must be the same before reads may come from either, writes
+//  go to both meanwhile so the blocks already compared stay the same
+static bool mirror_compare(int drive) {
+    static uint8_t primary[MIRROR_CHECK * BLOCK_SIZE];
+    static uint8_t secondary[MIRROR_CHECK * BLOCK_SIZE];
+
+    uint32_t block = mirror[drive].checked;
+    UINT count = hdd[drive].blocks - block < MIRROR_CHECK ? hdd[drive].blocks - block : MIRROR_CHECK;
+    FSIZE_t position = hdd[drive].offset + block * BLOCK_SIZE;
+    UINT br1, br2;
+
+    //  Multi-block reads bypass the block cache
+    if (!seek_file(drive, &hdd[drive].image, position) ||
+        f_read(&hdd[drive].image, primary, count * BLOCK_SIZE, &br1) != FR_OK ||
+        !seek_file(drive, &mirror[drive].image, position) ||
+        f_read(&mirror[drive].image, secondary, count * BLOCK_SIZE, &br2) != FR_OK ||
+        br1 != br2 || memcmp(primary, secondary, br1)) {
+        return false;
+    }
+
+    mirror[drive].checked += count;
+    return true;
+}
+
+static bool mirror_verify(void) {
+    for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        if (!mirror[drive].active || mirror[drive].verified) {
+            continue;
         }
 
-        char *extension = strrchr(path, '.');
-        if (extension && strcasecmp(extension, ".2mg") == 0) {
-            hdd[drive].offset = 0x40;
-            printf("  2MG\n");
+        if (!mirror_compare(drive)) {
+            printf("HDD Mirror Out Of Sync(Drive=%d,Block=%lu)\n", drive, mirror[drive].checked);
+            mirror_close(drive);
+        } else if (mirror[drive].checked >= hdd[drive].blocks) {
+            mirror[drive].verified = true;
+            printf("HDD Mirrored(Drive=%d)\n", drive);
         }
+        return true;
+    }
+
+    return false;
+}
+
+static void mirror_open(int drive, const char *path) {
+    if (strncasecmp(path, MIRROR_PREFIX, strlen(MIRROR_PREFIX)) || hdd[drive].error || hdd[drive].thin) {
+        return;
+    }
+
+    if (!usb) {
+        printf("  Mirror Degraded\n");
+        return;
+    }
+
+    char usb_path[MAX_PATH];
+    snprintf(usb_path, MAX_PATH, "USB:%s", path + strlen(MIRROR_PREFIX));
+
+    FIL *fp = &mirror[drive].image;
+    FRESULT fr = f_open(fp, usb_path, FA_OPEN_EXISTING | FA_READ | (hdd[drive].prot ? 0 : FA_WRITE));
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", usb_path, FRESULT_str(fr), fr);
+        printf("  Mirror Degraded\n");
+        return;
+    }
+
+    if (f_size(fp) != f_size(&hdd[drive].image)) {
+        printf("  Mirror Out Of Sync\n");
+        f_close(fp);
+        return;
+    }
+
+    //  hdd_task() compares the copies, until then reads stay on SD:
+    memset(&mirror[drive].latency, 0, sizeof(mirror[drive].latency));
+    memset(&mirror[drive].count, 0, sizeof(mirror[drive].count));
+    mirror[drive].checked = 0;
+    mirror[drive].verified = false;
+    mirror[drive].active = true;
+    printf("  Mirror Verifying\n");
+}
+
+//  Read from the side that has been faster for this block range lately,
+//  a busy medium (prefetch, host traffic) shows up as higher latency
+static int mirror_pick(int drive, uint16_t block) {
+    if (!mirror[drive].verified) {
+        return 0;
+    }
+
+    uint8_t region = block / (0x10000 / MIRROR_REGIONS);
+    int side = mirror[drive].latency[1][region] < mirror[drive].latency[0][region];
+
+    //  Keep the estimate of the other side current
+    if (++mirror[drive].count[region] % MIRROR_PROBE == 0) {
+        side = !side;
+    }
+
+    return side;
+}
+
+static void mirror_timed(int drive, uint16_t block, int side, uint32_t us) {
+    if (!mirror[drive].active) {
+        return;
+    }
+
+    uint32_t *latency = &mirror[drive].latency[side][block / (0x10000 / MIRROR_REGIONS)];
+    *latency = *latency ? (*latency * 7 + us) / 8 : us;
+    mirror[drive].reads[side]++;
+}
+
+static bool mirror_write(int drive, uint16_t block, const uint8_t *data) {
+    if (!seek_file(drive, &mirror[drive].image, hdd[drive].offset + block * BLOCK_SIZE)) {
+        return false;
+    }
+
+    UINT bw;
+    FRESULT fr = f_write(&mirror[drive].image, data, BLOCK_SIZE, &bw);
+    if (fr != FR_OK || bw != BLOCK_SIZE) {
+        printf("f_write(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    fr = f_sync(&mirror[drive].image);
+    if (fr != FR_OK) {
+        printf("f_sync(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+        return false;
+    }
 
+    return true;
+}
+#endif
+
+static void image_blocks(int drive, const char *path) {
+    hdd[drive].offset = 0;
+    hdd[drive].thin = false;
+
+    char *extension = strrchr(path, '.');
+    if (extension && strcasecmp(extension, ".2mg") == 0) {
+        hdd[drive].offset = 0x40;
+        printf("  2MG\n");
+    }
+
+    if (extension && strcasecmp(extension, ".tpo") == 0) {
+        hdd[drive].blocks = thin_open(drive);
+    } else {
         int32_t raw_blocks = (f_size(&hdd[drive].image) - hdd[drive].offset) / BLOCK_SIZE;
         hdd[drive].blocks = raw_blocks > 0xFFFF ? 0xFFFF: raw_blocks;
-        printf("  %u Blocks\n", hdd[drive].blocks);
+    }
+    printf("  %u Blocks\n", hdd[drive].blocks);
+}
+
+#if USE_DISK_SETS
+static bool is_set(const char *path) {
+    return !strncasecmp(path, SET_PREFIX, strlen(SET_PREFIX));
+}
+
+//  Case insensitive, * and ?
+static bool matches(const char *pattern, const char *name) {
+    for (; *pattern; pattern++, name++) {
+        if (*pattern == '*') {
+            for (const char *rest = name; ; rest++) {
+                if (matches(pattern + 1, rest)) {
+                    return true;
+                }
+                if (!*rest) {
+                    return false;
+                }
+            }
+        }
+        if (!*name || (*pattern != '?' && toupper(*pattern) != toupper(*name))) {
+            return false;
+        }
+    }
+    return !*name;
+}
+
+static int path_compare(const void *p1, const void *p2) {
+    return strcasecmp(p1, p2);
+}
+
+static FIL *set_member(int i) {
+    return i == set.current ? &hdd[set.drive].image : &set.member[i];
+}
+
+static void set_close(void) {
+    for (int i = 0; i < set.count; i++) {
+        FRESULT fr = f_close(set_member(i));
+        if (fr != FR_OK) {
+            printf("f_close(%s) error: %s (%d)\n", set.path[i], FRESULT_str(fr), fr);
+        }
+    }
+    memset(set.member, 0, sizeof(set.member));
+    set.count = 0;
+    set.drive = -1;
+}
+
+//  Open, map and warm up every image matching the pattern, the first one becomes the drive image
+static bool set_open(int drive, const char *path) {
+    if (set.drive >= 0 && hdd[set.drive].parked) {
+        //  Left over from before a reset, its drive hasn't been opened again
+        int parked = set.drive;
+        printf("HDD Close(Drive=%d)\n", parked);
+        set_close();
+        memset(&hdd[parked], 0, sizeof(hdd[parked]));
+    }
+    if (set.drive >= 0) {
+        printf("  Disk Set In Use\n");
+        return false;
+    }
+
+    char dir[MAX_PATH];
+    snprintf(dir, MAX_PATH, "%s", path + strlen(SET_PREFIX));
+    char *slash = strrchr(dir, '/');
+    if (!slash) {
+        return false;
+    }
+    *slash = '\0';
+    const char *pattern = slash + 1;
+
+    DIR listing;
+    FRESULT fr = f_opendir(&listing, dir[0] && dir[strlen(dir) - 1] != ':' ? dir : strcat(dir, "/"));
+    if (fr != FR_OK) {
+        printf("f_opendir(%s) error: %s (%d)\n", dir, FRESULT_str(fr), fr);
+        return false;
+    }
+    if (dir[strlen(dir) - 1] == '/') {
+        dir[strlen(dir) - 1] = '\0';
+    }
+
+    set.count = 0;
+    FILINFO fno;
+    while (set.count < SET_MEMBERS && f_readdir(&listing, &fno) == FR_OK && fno.fname[0]) {
+        if (!(fno.fattrib & AM_DIR) && matches(pattern, fno.fname)) {
+            snprintf(set.path[set.count++], MAX_PATH, "%s/%s", dir, fno.fname);
+        }
+    }
+    f_closedir(&listing);
+    qsort(set.path, set.count, MAX_PATH, path_compare);
+
+    static uint8_t scratch[BLOCK_SIZE];
+    for (int i = 0; i < set.count; i++) {
+        FIL *fp = &set.member[i];
+        set.prot[i] = false;
+        fr = f_open(fp, set.path[i], FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+        if (fr == FR_DENIED) {
+            fr = f_open(fp, set.path[i], FA_OPEN_EXISTING | FA_READ);
+            set.prot[i] = true;
+        }
+        if (fr != FR_OK) {
+            printf("f_open(%s) error: %s (%d)\n", set.path[i], FRESULT_str(fr), fr);
+            set.drive = drive;
+            set.current = -1;
+            set.count = i;
+            set_close();
+            return false;
+        }
+        printf("  %s%s\n", set.path[i], set.prot[i] ? " (Write-Protected)" : "");
+
+        //  Seeks without walking the FAT, thin images grow and can't have one
+        char *extension = strrchr(set.path[i], '.');
+        if (!extension || strcasecmp(extension, ".tpo")) {
+            set.linkmap[i][0] = SET_LINKMAP;
+            fp->cltbl = set.linkmap[i];
+            if (f_lseek(fp, CREATE_LINKMAP) != FR_OK) {
+                fp->cltbl = NULL;
+            }
+        }
+
+        //  One block at a time, multi-sector reads bypass the block cache
+        for (int block = 0; block < SET_WARM && f_lseek(fp, block * BLOCK_SIZE) == FR_OK; block++) {
+            UINT br;
+            if (f_read(fp, scratch, BLOCK_SIZE, &br) != FR_OK || br != BLOCK_SIZE) {
+                break;
+            }
+        }
+    }
+
+    if (!set.count) {
+        printf("  Empty Disk Set\n");
+        return false;
+    }
+
+    set.drive = drive;
+    set.current = 0;
+    hdd[drive].image = set.member[0];
+    hdd[drive].prot = set.prot[0];
+    printf("  Disk Set of %d\n", set.count);
+    return true;
+}
+
+//  Sync every member and keep its directory entry, false if one can't be
+static bool set_park(void) {
+    for (int i = 0; i < set.count; i++) {
+        FIL *fp = set_member(i);
+        if (f_sync(fp) != FR_OK || !read_entry(fp, set.entry[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//  Reuse a parked set if the path and every member are unchanged, the member that was in stays in
+static bool set_unpark(int drive, const char *path) {
+    hdd[drive].parked = false;
+
+    bool same = !strcmp(hdd[drive].path, path);
+    for (int i = 0; same && i < set.count; i++) {
+        FIL *fp = set_member(i);
+        BYTE entry[ENTRY_SIZE];
+        same = fp->obj.fs->fs_type && fp->obj.fs->id == fp->obj.id &&
+               read_entry(fp, entry) && !memcmp(entry, set.entry[i], ENTRY_SIZE);
+        fp->fptr = 0;
+        fp->sect = 0;               //  Drop the buffered sector
+    }
+    if (same) {
+        return true;
+    }
+
+    printf("HDD Close(Drive=%d)\n", drive);
+    set_close();
+    memset(&hdd[drive].image, 0, sizeof(FIL));
+    hdd[drive].prot = false;
+    return false;
+}
+#endif
+
+#if USE_HOT_BLOCKS || USE_BLOCK_PREFETCH
+static uint32_t path_hash(const char *path) {
+    uint32_t hash = 2166136261u;    //  FNV-1a
+    while (*path) {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+    return hash;
+}
+#endif
+
+#if USE_BLOCK_PREFETCH
+static void prefetch_clear(int drive, uint32_t id) {
+    memset(successor[drive], 0, sizeof(successor[drive]));
+    memset(&prefetch[drive], 0, sizeof(prefetch[drive]));
+    prefetch[drive].id = id;
+    if (prefetch_drive == drive) {
+        prefetch_drive = -1;
+    }
+}
+#endif
+
+#if USE_HOT_BLOCKS
+static void hot_clear(int drive, uint32_t id) {
+    memset(&hot[drive], 0, sizeof(hot[drive]));
+    hot[drive].id = id;
+}
+
+//  Neighbouring blocks share a counter only when the volume has more blocks than counters
+static uint16_t hot_index(int drive, uint16_t block) {
+    int shift = 0;
+    while ((uint16_t)(hdd[drive].blocks - 1) >> shift >= HOT_COUNTERS) {
+        shift++;
+    }
+    return block >> shift;
+}
+
+static uint8_t hot_estimate(int drive, uint16_t block) {
+    uint16_t index = hot_index(drive, block);
+    return hot[drive].count[index / 2] >> (index % 2 * 4) & 0x0F;
+}
+
+static void hot_count(int drive, uint16_t block) {
+    if (hot_estimate(drive, block) == HOT_MAX) {
+        for (int i = 0; i < HOT_COUNTERS / 2; i++) {
+            hot[drive].count[i] = hot[drive].count[i] >> 1 & 0x77;
+        }
+        hot[drive].halvings++;
+    }
+    uint16_t index = hot_index(drive, block);
+    hot[drive].count[index / 2] += 1 << (index % 2 * 4);
+    hot[drive].accesses++;
+}
+#endif
+
+#if USE_VIRTUAL_DIR
+static bool is_vdir(const char *path) {
+    return !strncasecmp(path, VDIR_PREFIX, strlen(VDIR_PREFIX));
+}
+#endif
+
+static uint16_t get_blocks(int drive) {
+    if (!hdd[drive].error && !hdd[drive].vdir && (hdd[drive].parked || !f_size(&hdd[drive].image))) {
+        char *path = config_drivepath(drive);
+
+#if USE_HOT_BLOCKS
+        //  Reopening the same image keeps its counts
+        if (hot[drive].id != path_hash(path)) {
+            hot_clear(drive, path_hash(path));
+        }
+#endif
+
+#if USE_BLOCK_PREFETCH
+        //  And its successors
+        if (prefetch[drive].id != path_hash(path)) {
+            prefetch_clear(drive, path_hash(path));
+        }
+#endif
+
+#if USE_DISK_SETS
+        if (hdd[drive].parked && set.drive == drive && set_unpark(drive, path)) {
+            printf("HDD Reopen(Drive=%d,File=%s)\n", drive, set.path[set.current]);
+            image_blocks(drive, set.path[set.current]);
+            return hdd[drive].blocks;
+        }
+#endif
+
+        if (hdd[drive].parked && unpark(drive, path)) {
+            printf("HDD Reopen(Drive=%d,File=%s)\n", drive, path);
+        } else {
+            printf("HDD Open(Drive=%d,File=%s)\n", drive, path);
+
+#if USE_VIRTUAL_DIR
+            if (is_vdir(path)) {
+                hdd[drive].blocks = vdir_open(path + strlen(VDIR_PREFIX));
+                hdd[drive].vdir = hdd[drive].blocks != 0;
+                hdd[drive].error = !hdd[drive].vdir;
+                hdd[drive].prot = true;
+                strncpy(hdd[drive].path, path, MAX_PATH - 1);
+                return hdd[drive].blocks;
+            }
+#endif
+#if USE_DISK_SETS
+            if (is_set(path)) {
+                if (!set_open(drive, path)) {
+                    hdd[drive].error = true;
+                }
+                strncpy(hdd[drive].path, path, MAX_PATH - 1);
+                if (hdd[drive].error) {
+                    return 0;
+                }
+                image_blocks(drive, set.path[set.current]);
+                return hdd[drive].blocks;
+            }
+#endif
+#if USE_MIRROR
+            char buffer[MAX_PATH];
+            const char *image = open_path(path, buffer);
+#else
+            const char *image = path;
+#endif
+            FRESULT fr = f_open(&hdd[drive].image, image, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+            if (fr == FR_DENIED) {
+                printf("  Write-Protected\n");
+                fr = f_open(&hdd[drive].image, image, FA_OPEN_EXISTING | FA_READ);
+                hdd[drive].prot = true;
+            }
+            if (fr != FR_OK) {
+                printf("f_open(%s) error: %s (%d)\n", image, FRESULT_str(fr), fr);
+                hdd[drive].error = true;
+            }
+            strncpy(hdd[drive].path, path, MAX_PATH - 1);
+        }
+
+        image_blocks(drive, path);
+
+#if USE_MIRROR
+        mirror_open(drive, path);
+#endif
     }
 
     return hdd[drive].blocks;
@@ -88,14 +889,260 @@ static bool seek_block(int drive, uint16_t block) {
         return false;
     }
 
-    FRESULT fr = f_lseek(&hdd[drive].image, hdd[drive].offset + block * BLOCK_SIZE);
-    if (fr != FR_OK) {
-        printf("f_lseek(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+    return seek_position(drive, hdd[drive].offset + block * BLOCK_SIZE);
+}
+
+//  Thin images read a single block, others count adjacent blocks in one f_read()
+static uint8_t read_blocks(uint8_t drive, uint16_t block, uint8_t count, uint8_t *data) {
+    if (block >= get_blocks(drive) || block + count > get_blocks(drive)) {
+        return IO_ERROR;
+    }
+
+#if USE_VIRTUAL_DIR
+    if (hdd[drive].vdir) {
+        for (int i = 0; i < count; i++) {
+            if (!vdir_read(block + i, &data[i * BLOCK_SIZE])) {
+                return IO_ERROR;
+            }
+        }
+        return SUCCESS;
+    }
+#endif
+
+    FIL *fp = &hdd[drive].image;
+#if USE_MIRROR
+    int side = 0;
+#endif
+
+    if (hdd[drive].thin) {
+        int32_t slot = thin_slot(drive, block);
+        if (slot < 0) {
+            return IO_ERROR;
+        }
+        if (!slot) {
+            memset(data, 0x00, BLOCK_SIZE);
+            return SUCCESS;
+        }
+        if (!seek_position(drive, hdd[drive].data_offset + (slot - 1) * BLOCK_SIZE)) {
+            return IO_ERROR;
+        }
+    } else {
+#if USE_MIRROR
+        side = mirror_pick(drive, block);
+        if (side) {
+            fp = &mirror[drive].image;
+        }
+#endif
+        if (!seek_file(drive, fp, hdd[drive].offset + block * BLOCK_SIZE)) {
+            return IO_ERROR;
+        }
+    }
+
+#if USE_MIRROR
+    uint32_t start = time_us_32();
+#endif
+
+    UINT br;
+    FRESULT fr = f_read(fp, data, count * BLOCK_SIZE, &br);
+    if (fr != FR_OK || br != count * BLOCK_SIZE) {
+        printf("f_read(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+#if USE_MIRROR
+        if (side) {
+            printf("HDD Mirror Degraded(Drive=%d)\n", drive);
+            mirror_close(drive);
+            return read_blocks(drive, block, count, data);
+        }
+#endif
+        return IO_ERROR;
+    }
+
+#if USE_MIRROR
+    mirror_timed(drive, block, side, (time_us_32() - start) / count);
+#endif
+
+    return SUCCESS;
+}
+
+static uint8_t read_block(uint8_t drive, uint16_t block, uint8_t *data) {
+#if USE_READ_BATCH
+    if (batch.drive == drive && batch.generation == generation[drive] &&
+        block >= batch.block && block < batch.block + batch.count) {
+        memcpy(data, &batch.data[(block - batch.block) * BLOCK_SIZE], BLOCK_SIZE);
+        batch.hits++;
+#if USE_READ_AHEAD
+        if (batch.ahead) {
+            ahead[drive].hits++;
+            batch.ahead = false;
+        }
+        //  The last block of the run, follow the image not the SD card
+        batch.refill = block == batch.block + batch.count - 1;
+#endif
+        batch.last_drive = drive;
+        batch.last_block = block;
+        return SUCCESS;
+    }
+
+    //  The second block of a run fetches the rest of the batch with it
+    bool sequential = batch.last_drive == drive && (uint16_t)(batch.last_block + 1) == block;
+    batch.last_drive = drive;
+    batch.last_block = block;
+
+    if (sequential && !hdd[drive].thin && block < get_blocks(drive)) {
+        uint8_t count = get_blocks(drive) - block < READ_BATCH_BLOCKS ? get_blocks(drive) - block : READ_BATCH_BLOCKS;
+
+#if USE_READ_AHEAD
+        if (batch.drive >= 0 && batch.ahead) {
+            ahead[batch.drive].wasted++;
+        }
+        batch.ahead = false;
+        batch.refill = false;
+#endif
+        batch.drive = -1;
+        if (read_blocks(drive, block, count, batch.data) != SUCCESS) {
+            return read_blocks(drive, block, 1, data);
+        }
+        batch.drive = drive;
+        batch.block = block;
+        batch.count = count;
+        batch.generation = generation[drive];
+        batch.reads++;
+
+        memcpy(data, batch.data, BLOCK_SIZE);
+        return SUCCESS;
+    }
+#endif
+
+    return read_blocks(drive, block, 1, data);
+}
+
+#if USE_READ_BATCH && USE_READ_AHEAD
+static bool read_ahead(void) {
+    if (!batch.refill) {
+        return false;
+    }
+    batch.refill = false;
+
+    //  Only a run the host is still reading, and only data blocks, never FatFs metadata
+    if (batch.drive < 0 || batch.generation != generation[batch.drive] || hdd[batch.drive].thin) {
+        return false;
+    }
+
+    uint8_t drive = batch.drive;
+    uint16_t block = batch.block + batch.count;
+    if (batch.count != READ_BATCH_BLOCKS || block >= get_blocks(drive)) {
         return false;
     }
+    uint8_t count = get_blocks(drive) - block < READ_BATCH_BLOCKS ? get_blocks(drive) - block : READ_BATCH_BLOCKS;
 
+    //  f_read() maps the blocks through the image's cluster chain
+    batch.drive = -1;
+    if (read_blocks(drive, block, count, batch.data) != SUCCESS) {
+        return true;
+    }
+    batch.drive = drive;
+    batch.block = block;
+    batch.count = count;
+    batch.generation = generation[drive];
+    batch.ahead = true;
+    ahead[drive].issued++;
     return true;
 }
+#endif
+
+#if USE_BLOCK_PREFETCH
+static void prefetch_learn(uint8_t drive, uint16_t block) {
+    //  Was it prefetched?
+    for (int i = 0; i < PREFETCH_RECENT; i++) {
+        if ((prefetch[drive].recent_valid & (1 << i)) && prefetch[drive].recent[i] == block) {
+            prefetch[drive].recent_valid &= ~(1 << i);
+            prefetch[drive].hits++;
+            prefetch[drive].window_hits++;
+            break;
+        }
+    }
+
+    //  Teach the table that block follows last
+    if (prefetch[drive].last_valid) {
+        uint16_t last = prefetch[drive].last;
+        struct successor *entry = &successor[drive][last & (PREFETCH_ENTRIES - 1)];
+
+        if (entry->block != last || !entry->conf[0]) {
+            memset(entry, 0, sizeof(*entry));
+            entry->block = last;
+        }
+
+        if (entry->conf[0] && entry->next[0] == block) {
+            if (entry->conf[0] < PREFETCH_CONF_MAX) {
+                entry->conf[0]++;
+            }
+        } else if (entry->conf[1] && entry->next[1] == block) {
+            if (entry->conf[1] < PREFETCH_CONF_MAX) {
+                entry->conf[1]++;
+            }
+        } else if (!entry->conf[0]) {
+            entry->next[0] = block;
+            entry->conf[0] = 1;
+        } else {
+            //  A new successor, age the old ones
+            if (entry->conf[0] > 1) {
+                entry->conf[0]--;
+            }
+            if (entry->conf[1]) {
+                entry->conf[1]--;
+            }
+            if (!entry->conf[1]) {
+                entry->next[1] = block;
+                entry->conf[1] = 1;
+            }
+        }
+
+        if (entry->conf[1] > entry->conf[0]) {
+            uint16_t next = entry->next[0];
+            uint8_t  conf = entry->conf[0];
+            entry->next[0] = entry->next[1];
+            entry->conf[0] = entry->conf[1];
+            entry->next[1] = next;
+            entry->conf[1] = conf;
+        }
+    }
+    prefetch[drive].last = block;
+    prefetch[drive].last_valid = true;
+
+    if (prefetch[drive].disabled) {
+        return;
+    }
+
+    //  Queue the most likely successor, the next block is left to the read-ahead
+    struct successor *entry = &successor[drive][block & (PREFETCH_ENTRIES - 1)];
+    if (entry->block == block && entry->conf[0] >= PREFETCH_CONF_MIN && entry->next[0] != block + 1) {
+        prefetch_drive = drive;
+        prefetch_block = entry->next[0];
+    }
+}
+
+static void prefetch_issued(uint8_t drive, uint16_t block) {
+    uint8_t i = prefetch[drive].recent_next;
+    prefetch[drive].recent_next = (i + 1) % PREFETCH_RECENT;
+
+    if (prefetch[drive].recent_valid & (1 << i)) {
+        prefetch[drive].wasted++;
+    }
+    prefetch[drive].recent[i] = block;
+    prefetch[drive].recent_valid |= 1 << i;
+
+    prefetch[drive].issued++;
+    if (++prefetch[drive].window_issued < PREFETCH_WINDOW) {
+        return;
+    }
+
+    if (prefetch[drive].window_hits * PREFETCH_ACCURACY < prefetch[drive].window_issued) {
+        printf("HDD Prefetch Disabled(Drive=%d,Hits=%d/%d)\n", drive, prefetch[drive].window_hits, prefetch[drive].window_issued);
+        prefetch[drive].disabled = true;
+    }
+    prefetch[drive].window_issued = 0;
+    prefetch[drive].window_hits = 0;
+}
+#endif
 
 void hdd_init(void) {
     time_init();
@@ -108,23 +1155,103 @@ void hdd_init(void) {
         return;
     }
 
+    int replayed = write_log_mount(&sd_card->fatfs);
+    if (replayed < 0) {
+        //  Newer sectors are stuck in the log, the card stays unused until the next try
+        f_unmount("SD:");
+        return;
+    }
+    if (replayed > 0) {
+        //  The replay wrote past the block cache, the sectors FatFs read so far may be stale.
+        //  disk_flush() only invalidates if something is dirty.
+        block_cache_sync_range(sd_card->fatfs.pdrv, 0, UINT32_MAX, true);
+        f_unmount("SD:");
+        fr = f_mount(&sd_card->fatfs, "SD:", 1);
+        if (fr != FR_OK) {
+            printf("f_mount(SD:) error: %s (%d)\n", FRESULT_str(fr), fr);
+            return;
+        }
+    }
+    freespace_mount(&sd_card->fatfs);
+
     sd = true;
 }
 
 void hdd_reset(void) {
     for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        generation[drive]++;
+
+#if USE_MIRROR
+        mirror_close(drive);        //  Not parked, get_blocks() checks the copies again
+#endif
+
+#if USE_VIRTUAL_DIR
+        if (hdd[drive].vdir) {
+            printf("HDD Close(Drive=%d)\n", drive);
+            vdir_close();
+            memset(&hdd[drive], 0, sizeof(hdd[drive]));
+            continue;
+        }
+#endif
+
+#if USE_DISK_SETS
+        if (set.drive == drive) {
+            //  Kept open with the member that is in, get_blocks() checks the set is unchanged
+            if (set_park()) {
+                hdd[drive].offset = 0;
+                hdd[drive].blocks = 0;
+                hdd[drive].thin = false;
+                hdd[drive].parked = true;
+                continue;
+            }
+
+            printf("HDD Close(Drive=%d)\n", drive);
+            set_close();
+            memset(&hdd[drive], 0, sizeof(hdd[drive]));
+            continue;
+        }
+#endif
+
+        if (hdd[drive].parked) {
+            continue;
+        }
+
         if (!f_size(&hdd[drive].image)) {
+            memset(&hdd[drive], 0, sizeof(hdd[drive]));
+            continue;
+        }
+
+        //  Keep the image open, get_blocks() checks it is still the same file
+        FRESULT fr = f_sync(&hdd[drive].image);
+        if (fr == FR_OK && read_entry(&hdd[drive].image, hdd[drive].entry)) {
+            hdd[drive].offset = 0;
+            hdd[drive].blocks = 0;
+            hdd[drive].thin = false;
+            hdd[drive].parked = true;
             continue;
         }
 
         printf("HDD Close(Drive=%d)\n", drive);
 
-        FRESULT fr = f_close(&hdd[drive].image);
+        fr = f_close(&hdd[drive].image);
         if (fr != FR_OK) {
             printf("f_close(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
         }
+        memset(&hdd[drive], 0, sizeof(hdd[drive]));
+    }
+
+#if USE_BLOCK_PREFETCH
+    //  The successors stay with the image, get_blocks() drops them if another one goes in.
+    //  The host starts over, so does the accuracy check.
+    for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        prefetch[drive].last_valid = false;
+        prefetch[drive].disabled = false;
+        prefetch[drive].recent_valid = 0;
+        prefetch[drive].window_issued = 0;
+        prefetch[drive].window_hits = 0;
     }
-    memset(hdd, 0, sizeof(hdd));
+    prefetch_drive = -1;
+#endif
 }
 
 void hdd_mount_usb(bool mount) {
@@ -141,6 +1268,7 @@ void hdd_mount_usb(bool mount) {
             printf("f_mount(USB:) error: %s (%d)\n", FRESULT_str(fr), fr);
             return;
         }
+        freespace_mount(&fatfs);
 
         fr = f_chdrive("USB:");
         if (fr != FR_OK) {
@@ -172,6 +1300,10 @@ bool hdd_usb_mounted(void) {
     return usb;
 }
 
+uint32_t hdd_generation(uint8_t drive) {
+    return drive < MAX_DRIVES ? generation[drive] : 0;
+}
+
 bool hdd_protected(uint8_t drive) {
     return hdd[drive].prot;
 }
@@ -191,31 +1323,142 @@ uint8_t hdd_status(uint8_t drive, uint8_t *data) {
     return SUCCESS;
 }
 
+//  The first read or write after a swap fails once, so the host reads the new volume
+static bool report_switch(int drive) {
+    if (!hdd[drive].switched) {
+        return false;
+    }
+    hdd[drive].switched = false;
+    printf("HDD Switched(Drive=%d)\n", drive);
+    return true;
+}
+
 uint8_t hdd_read(uint8_t drive, uint16_t block, uint8_t *data) {
 //    printf("HDD Read(Drive=%d,Block=$%04X)\n", drive, block);
 
-    if (!seek_block(drive, block)) {
-        return IO_ERROR;
+    if (report_switch(drive)) {
+        return DISK_SWITCHED;
     }
 
-    UINT br;
-    FRESULT fr = f_read(&hdd[drive].image, data, BLOCK_SIZE, &br);
-    if (fr != FR_OK || br != BLOCK_SIZE) {
-        printf("f_read(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
-        return IO_ERROR;
+    uint8_t retval = read_block(drive, block, data);
+
+#if USE_BLOCK_PREFETCH
+    if (retval == SUCCESS) {
+        prefetch_learn(drive, block);
     }
+#endif
+#if USE_HOT_BLOCKS
+    if (retval == SUCCESS) {
+        hot_count(drive, block);
+    }
+#endif
 
-    return SUCCESS;
+    return retval;
 }
 
+//  Read a block the host hasn't asked for yet, the access pattern isn't learned
+uint8_t hdd_read_ahead(uint8_t drive, uint16_t block, uint8_t *data) {
+    return read_block(drive, block, data);
+}
+
+//  The host got a block read ahead earlier
+void hdd_served(uint8_t drive, uint16_t block) {
+#if USE_BLOCK_PREFETCH
+    prefetch_learn(drive, block);
+#endif
+#if USE_HOT_BLOCKS
+    hot_count(drive, block);
+#endif
+}
+
+//  Put another member of the drive's disk set in, HDD_SWAP_NEXT cycles through them
+bool hdd_swap(uint8_t drive, uint8_t member) {
+#if USE_DISK_SETS
+    if (set.drive != drive || (member >= set.count && member != HDD_SWAP_NEXT)) {
+        return false;
+    }
+    if (member == HDD_SWAP_NEXT) {
+        member = (set.current + 1) % set.count;
+    }
+
+    set.member[set.current] = hdd[drive].image;
+    hdd[drive].image = set.member[member];
+    hdd[drive].prot = set.prot[member];
+    hdd[drive].switched = true;
+    set.current = member;
+
+    printf("HDD Swap(Drive=%d,File=%s)\n", drive, set.path[member]);
+    image_blocks(drive, set.path[member]);
+
+    //  Only this drive's cached view is stale, nothing is flushed or closed
+    generation[drive]++;
+#if USE_HOT_BLOCKS
+    hot_clear(drive, hot[drive].id);
+#endif
+#if USE_BLOCK_PREFETCH
+    prefetch_clear(drive, prefetch[drive].id);
+#endif
+    return true;
+#else
+    return false;
+#endif
+}
 
 uint8_t hdd_write(uint8_t drive, uint16_t block, const uint8_t *data) {
 //    printf("HDD Write(Drive=d,Block=$%04X)\n", drive, block);
 
-    if (!seek_block(drive, block)) {
+    if (block >= get_blocks(drive)) {
+        return IO_ERROR;
+    }
+
+    if (hdd[drive].vdir) {
+        return WRITE_PROT;
+    }
+
+    if (report_switch(drive)) {
+        return DISK_SWITCHED;
+    }
+
+#if USE_HOT_BLOCKS
+    hot_count(drive, block);
+#endif
+
+    int32_t slot = 0;
+    bool allocate = false;
+
+    if (hdd[drive].thin) {
+        if (hdd[drive].prot) {
+            return WRITE_PROT;
+        }
+        slot = thin_slot(drive, block);
+        if (slot < 0) {
+            return IO_ERROR;
+        }
+        if (!slot) {
+            if (is_zero(data)) {
+                return SUCCESS;     //  Still reads as zeros
+            }
+            //  Append a slot, rounding up after an interrupted append
+            slot = (f_size(&hdd[drive].image) - hdd[drive].data_offset + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+            if (slot > THIN_MAX_BLOCKS) {
+                return IO_ERROR;
+            }
+            allocate = true;
+        }
+        if (!seek_position(drive, hdd[drive].data_offset + (slot - 1) * BLOCK_SIZE)) {
+            return IO_ERROR;
+        }
+    } else if (!seek_block(drive, block)) {
         return IO_ERROR;
     }
 
+    //  ProDOS rewrites directory and bitmap blocks unchanged a lot
+    if (!allocate && !hdd[drive].prot && is_unchanged(drive, data)) {
+        writes_same++;
+        return SUCCESS;
+    }
+    generation[drive]++;
+
     UINT bw;
     FRESULT fr = f_write(&hdd[drive].image, data, BLOCK_SIZE, &bw);
     if (fr != FR_OK || bw != BLOCK_SIZE) {
@@ -226,11 +1469,228 @@ uint8_t hdd_write(uint8_t drive, uint16_t block, const uint8_t *data) {
         return IO_ERROR;
     }
 
+    //  The data and the grown file reach the medium before the map entry points
+    //  at them (f_sync() flushes the block cache), a lost append only leaks the slot
+    if (allocate) {
+        fr = f_sync(&hdd[drive].image);
+        if (fr != FR_OK) {
+            printf("f_sync(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
+            return IO_ERROR;
+        }
+        if (!thin_set_slot(drive, block, slot)) {
+            return IO_ERROR;
+        }
+    }
+
     fr = f_sync(&hdd[drive].image);
     if (fr != FR_OK) {
         printf("f_sync(%d) error: %s (%d)\n", drive, FRESULT_str(fr), fr);
         return IO_ERROR;
     }
 
+#if USE_MIRROR
+    //  The SD: copy stays authoritative, a failing USB: copy is dropped
+    if (mirror[drive].active && !mirror_write(drive, block, data)) {
+        printf("HDD Mirror Degraded(Drive=%d)\n", drive);
+        mirror_close(drive);
+    }
+#endif
+
     return SUCCESS;
 }
+
+#if USE_HOT_BLOCKS
+//  The file behind the drive, NULL if there is none
+static const char *image_path(int drive, char *buffer) {
+#if USE_VIRTUAL_DIR
+    if (hdd[drive].vdir) {
+        return NULL;
+    }
+#endif
+#if USE_DISK_SETS
+    if (set.drive == drive) {
+        return set.path[set.current];
+    }
+#endif
+#if USE_MIRROR
+    return open_path(hdd[drive].path, buffer);
+#else
+    return hdd[drive].path;
+#endif
+}
+#endif
+
+//  Write the block access estimates of the drive's image to <image>.hot
+bool hdd_dump_hot(uint8_t drive) {
+#if USE_HOT_BLOCKS
+    uint16_t blocks = get_blocks(drive);
+    char buffer[MAX_PATH];
+    const char *image = blocks ? image_path(drive, buffer) : NULL;
+    if (!image) {
+        return false;
+    }
+
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s%s", image, HOT_SUFFIX);
+    printf("HDD Dump(Drive=%d,File=%s)\n", drive, path);
+
+    FIL fil;
+    FRESULT fr = f_open(&fil, path, FA_CREATE_ALWAYS | FA_WRITE);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    static uint8_t chunk[BLOCK_SIZE];
+    hot_header header = {
+        .version = HOT_VERSION,
+        .blocks = blocks,
+        .accesses = hot[drive].accesses,
+        .halvings = hot[drive].halvings,
+    };
+    memcpy(header.magic, HOT_MAGIC, sizeof(header.magic));
+    memset(chunk, 0x00, BLOCK_SIZE);
+    memcpy(chunk, &header, sizeof(header));
+
+    UINT bw;
+    fr = f_write(&fil, chunk, HOT_HEADER_SIZE, &bw);
+    for (uint32_t block = 0; fr == FR_OK && block < blocks; block += BLOCK_SIZE) {
+        UINT count = blocks - block < BLOCK_SIZE ? blocks - block : BLOCK_SIZE;
+        for (UINT i = 0; i < count; i++) {
+            chunk[i] = hot_estimate(drive, block + i);
+        }
+        fr = f_write(&fil, chunk, count, &bw);
+    }
+    if (fr != FR_OK) {
+        printf("f_write(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+    }
+
+    FRESULT fr_close = f_close(&fil);
+    if (fr_close != FR_OK) {
+        printf("f_close(%s) error: %s (%d)\n", path, FRESULT_str(fr_close), fr_close);
+    }
+    return fr == FR_OK && fr_close == FR_OK;
+#else
+    return false;
+#endif
+}
+
+bool hdd_create_thin(const char *path, uint16_t blocks) {
+    printf("HDD Create(File=%s,Blocks=%u)\n", path, blocks);
+
+    FIL file;
+    FRESULT fr = f_open(&file, path, FA_CREATE_NEW | FA_WRITE);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    static uint8_t sector[BLOCK_SIZE];
+    memset(sector, 0x00, BLOCK_SIZE);
+
+    thin_header *header = (thin_header *)sector;
+    memcpy(header->magic, THIN_MAGIC, sizeof(header->magic));
+    header->version = THIN_VERSION;
+    header->blocks = blocks;
+    header->data_offset = THIN_HEADER_SIZE + THIN_MAP_SIZE(blocks);
+
+    //  Header followed by an empty block map
+    for (uint32_t offset = 0; offset < header->data_offset && fr == FR_OK; offset += BLOCK_SIZE) {
+        UINT bw;
+        fr = f_write(&file, sector, BLOCK_SIZE, &bw);
+        if (fr == FR_OK && bw != BLOCK_SIZE) {
+            fr = FR_DENIED;
+        }
+        memset(sector, 0x00, sizeof(thin_header));
+    }
+
+    if (fr != FR_OK) {
+        printf("f_write(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        f_close(&file);
+        f_unlink(path);
+        return false;
+    }
+
+    fr = f_close(&file);
+    if (fr != FR_OK) {
+        printf("f_close(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return false;
+    }
+
+    return true;
+}
+
+bool hdd_task(void) {
+#if USE_READ_BATCH && USE_READ_AHEAD
+    if (read_ahead()) {
+        return true;
+    }
+#endif
+
+#if USE_MIRROR
+    if (mirror_verify()) {
+        return true;
+    }
+#endif
+
+#if USE_BLOCK_PREFETCH
+    if (prefetch_drive < 0) {
+        return false;
+    }
+
+    //  sp_poll() may answer a read while the SD card is busy, which learns the next prefetch
+    uint8_t drive = prefetch_drive;
+    uint16_t block = prefetch_block;
+    prefetch_drive = -1;
+
+    //  Only the block cache keeps the data, a run in progress isn't broken up
+    static uint8_t scratch[BLOCK_SIZE];
+    if (read_blocks(drive, block, 1, scratch) == SUCCESS) {
+        prefetch_issued(drive, block);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void hdd_print_stats(void) {
+#if IO_STATS
+    if (writes_same) {
+        printf("hdd:, Writes Unchanged, %lu,\n", writes_same);
+    }
+#endif
+#if IO_STATS && USE_READ_BATCH
+    if (batch.reads) {
+        printf("hdd:, Batched, %lu, Hit, %lu,\n", batch.reads, batch.hits);
+    }
+#endif
+#if IO_STATS && USE_READ_BATCH && USE_READ_AHEAD
+    for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        if (!ahead[drive].issued) {
+            continue;
+        }
+        printf("hdd:, Drive, %d, Read Ahead, %lu, Hit, %lu, Wasted, %lu,\n",
+            drive, ahead[drive].issued, ahead[drive].hits, ahead[drive].wasted);
+    }
+#endif
+#if IO_STATS && USE_MIRROR
+    for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        if (!mirror[drive].reads[0] && !mirror[drive].reads[1]) {
+            continue;
+        }
+        printf("hdd:, Drive, %d, Mirror SD, %lu, USB, %lu, Active, %d,\n",
+            drive, mirror[drive].reads[0], mirror[drive].reads[1], mirror[drive].active);
+    }
+#endif
+#if IO_STATS && USE_BLOCK_PREFETCH
+    for (int drive = 0; drive < MAX_DRIVES; drive++) {
+        if (!prefetch[drive].issued) {
+            continue;
+        }
+        printf("hdd:, Drive, %d, Prefetch, %lu, Hit, %lu, Wasted, %lu, Disabled, %d,\n",
+            drive, prefetch[drive].issued, prefetch[drive].hits, prefetch[drive].wasted, prefetch[drive].disabled);
+    }
+#endif
+}
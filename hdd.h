@@ -39,12 +39,30 @@ bool hdd_usb_mounted(void);
 
 uint8_t hdd_drives(void);
 
+uint32_t hdd_generation(uint8_t drive);
+
 bool hdd_protected(uint8_t drive);
 
 uint8_t hdd_status(uint8_t drive, uint8_t *data);
 
 uint8_t hdd_read(uint8_t drive, uint16_t block, uint8_t *data);
 
+uint8_t hdd_read_ahead(uint8_t drive, uint16_t block, uint8_t *data);
+
+void hdd_served(uint8_t drive, uint16_t block);
+
 uint8_t hdd_write(uint8_t drive, uint16_t block, const uint8_t *data);
 
+#define HDD_SWAP_NEXT   0xFF
+
+bool hdd_swap(uint8_t drive, uint8_t member);
+
+bool hdd_dump_hot(uint8_t drive);
+
+bool hdd_create_thin(const char *path, uint16_t blocks);
+
+bool hdd_task(void);
+
+void hdd_print_stats(void);
+
 #endif
@@ -0,0 +1,61 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef _HOT_H
+#define _HOT_H
+
+#include <stdint.h>
+
+/*
+
+Hot block dump (.hot) layout, all values little-endian:
+
+    0                   hot_header, padded to HOT_HEADER_SIZE
+    HOT_HEADER_SIZE     one uint8_t per volume block, its group's accesses
+
+The card has 4096 counters per drive. A volume with more blocks counts a
+group of 2, 4, 8 or 16 neighbouring blocks together, every block of a group
+shows the group's count. Blocks that weren't accessed in a group of their
+own read 0. All counters of a drive are halved when one reaches 15, so
+recent accesses weigh more. Written next to the image as <image>.hot on
+request.
+
+*/
+
+#define HOT_MAGIC           "A2HT"
+#define HOT_VERSION         1
+#define HOT_HEADER_SIZE     512
+#define HOT_SUFFIX          ".hot"
+
+typedef struct {
+    char     magic[4];
+    uint16_t version;
+    uint16_t blocks;            //  Volume size, one estimate per block follows
+    uint32_t accesses;          //  Reads and writes counted since the image was opened
+    uint32_t halvings;          //  Times the counters were aged
+} hot_header;
+
+#endif //   _HOT_H
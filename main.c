@@ -30,18 +30,48 @@ SOFTWARE.
 #include <hardware/structs/busctrl.h>
 #include <tusb.h>
 
+#include "adt.h"
 #include "board.h"
+#include "block_cache.h"
+#include "block_copy.h"
+#include "freespace.h"
+#include "hdd.h"
 #include "ser.h"
 #include "sp.h"
+#include "write_log.h"
 
 #include "main.h"
 
+#if BUS_STATS || IO_STATS
+#define STATS_INTERVAL_MS   10000
+
+static void stats_task(void) {
+    static absolute_time_t next_report;
+
+    if (absolute_time_diff_us(get_absolute_time(), next_report) > 0) {
+        return;
+    }
+    next_report = make_timeout_time_ms(STATS_INTERVAL_MS);
+
+    board_print_stats();
+    block_cache_print_stats();
+    block_copy_print_stats();
+    hdd_print_stats();
+    sp_print_stats();
+    freespace_print_stats();
+    write_log_print_stats();
+}
+#endif
+
 void io_task(void) {
 #if MEDIUM == SD
         tud_task();
-        ser_task();
+        if (!adt_task()) {
+            ser_task();
+        }
 #elif MEDIUM == USB
         tuh_task();
+        adt_task();
 #endif
 }
 
@@ -59,5 +89,8 @@ void main(void) {
     while (true) {
         io_task();
         sp_task();
+#if BUS_STATS || IO_STATS
+        stats_task();
+#endif
     }
 }
@@ -31,6 +31,40 @@ SOFTWARE.
 #include "config.h"
 #include "hdd.h"
 
+// SCSI commands not known to TinyUSB
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10   0x35
+#define SCSI_CMD_MODE_SENSE_10          0x5A
+#define SCSI_CMD_SERVICE_ACTION_IN_16   0x9E
+#define SCSI_SA_READ_CAPACITY_16        0x10
+
+#define MODE_PAGE_CACHING   0x08
+#define MODE_PAGE_ALL       0x3F
+
+static LBA_t sector_count;
+static bool write_back;     // The host saw WCE or syncs, it knows to send SYNCHRONIZE CACHE
+
+static uint32_t get_be32(const uint8_t *p) {
+    return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static LBA_t get_sector_count(void) {
+    // The card doesn't change size while we're running
+    if (!sector_count) {
+        if (disk_ioctl(0, GET_SECTOR_COUNT, &sector_count) != RES_OK) {
+            printf("disk_ioctl() error\n");
+            sector_count = 0;
+        }
+    }
+    return sector_count;
+}
+
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
 //    printf("MSC Read(LBA=$%08X)\n", lba);
 
@@ -55,8 +89,8 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
         return -1;
     }
 
-    // Avoid inconsistency in local FAT implementation
-    disk_flush();
+    // Avoid inconsistency in local FAT implementation. The block cache is shared,
+    // so the data itself may stay write-back, but only for a host that syncs
     hdd_reset();
     config_reset();
 
@@ -65,6 +99,11 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t*
         return -1;
     }
 
+    if (!write_back && disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK) {
+        printf("disk_ioctl(CTRL_SYNC) error\n");
+        return -1;
+    }
+
     return bufsize;
 }
 
@@ -80,6 +119,27 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
     memcpy(product_rev, rev, strlen(rev));
 }
 
+// The next host has to show again that it syncs
+void tud_umount_cb(void) {
+    write_back = false;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
+    if (start) {
+        return true;
+    }
+
+    // Ejected, the host may not sync before the cable is pulled
+    printf("MSC Stop\n");
+    write_back = false;
+    if (disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK) {
+        printf("disk_ioctl(CTRL_SYNC) error\n");
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+        return false;
+    }
+    return true;
+}
+
 bool tud_msc_test_unit_ready_cb(uint8_t lun) {
 //    printf("MSC Ready\n");
     return true;
@@ -89,15 +149,70 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
     printf("MSC Capacity\n");
 
     *block_size = FF_MAX_SS;
+    *block_count = get_sector_count();
+}
+
+static int32_t mode_sense_10(uint8_t const scsi_cmd[16], uint8_t* buffer, uint16_t bufsize) {
+    uint8_t page = scsi_cmd[2] & 0x3F;
+    bool changeable = (scsi_cmd[2] & 0xC0) == 0x40;
+    uint16_t alloc = scsi_cmd[7] << 8 | scsi_cmd[8];
+
+    uint8_t data[8 + 20];
+    memset(data, 0, sizeof(data));
+    int32_t len = 8;
+
+    if (page == MODE_PAGE_CACHING || page == MODE_PAGE_ALL) {
+        uint8_t *caching = &data[len];
+        caching[0] = MODE_PAGE_CACHING;
+        caching[1] = 0x12;                  // Page length
+        if (!changeable) {
+            caching[2] = 0x04;              // WCE: writes are cached until SYNCHRONIZE CACHE
+            write_back = true;
+        }
+        len += 20;
+    } else {
+        printf("MSC Mode Sense(Page=$%02X)\n", page);
+    }
+
+    data[0] = (len - 2) >> 8;               // Mode data length
+    data[1] = (len - 2);
+
+    if (len > alloc) {
+        len = alloc;
+    }
+    if (len > bufsize) {
+        len = bufsize;
+    }
+    memcpy(buffer, data, len);
+    return len;
+}
 
-    LBA_t sector_count;
-    if (disk_ioctl(0, GET_SECTOR_COUNT, &sector_count) != RES_OK) {
-        printf("disk_ioctl() error\n");
-        *block_count = 0;
-        return;
+static int32_t read_capacity_16(uint8_t lun, uint8_t const scsi_cmd[16], uint8_t* buffer, uint16_t bufsize) {
+    uint32_t alloc = get_be32(&scsi_cmd[10]);
+
+    LBA_t count = get_sector_count();
+    if (!count) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+        return -1;
     }
 
-    *block_count = sector_count;
+    uint8_t data[32];
+    memset(data, 0, sizeof(data));
+    put_be32(&data[0], (uint64_t)(count - 1) >> 32);
+    put_be32(&data[4], count - 1);
+    put_be32(&data[8], FF_MAX_SS);
+    // No LBPME: TinyUSB answers INQUIRY itself, so the Block Limits and Logical Block
+    // Provisioning VPD pages that have to go with it can't be served
+
+    uint32_t len = sizeof(data);
+    if (len > alloc) {
+        len = alloc;
+    }
+    if (len > bufsize) {
+        len = bufsize;
+    }
+    memcpy(buffer, data, len);
+    return len;
 }
 
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize) {
@@ -109,7 +224,29 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, u
         return 0;
     }
 
-    printf("MSC Other\n");
+    switch (scsi_cmd[0]) {
+        case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+            printf("MSC Sync\n");
+            write_back = true;
+
+            if (disk_ioctl(0, CTRL_SYNC, NULL) != RES_OK) {
+                printf("disk_ioctl(CTRL_SYNC) error\n");
+                tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+                return -1;
+            }
+            return 0;
+
+        case SCSI_CMD_MODE_SENSE_10:
+            return mode_sense_10(scsi_cmd, buffer, bufsize);
+
+        case SCSI_CMD_SERVICE_ACTION_IN_16:
+            if ((scsi_cmd[1] & 0x1F) == SCSI_SA_READ_CAPACITY_16) {
+                return read_capacity_16(lun, scsi_cmd, buffer, bufsize);
+            }
+            break;
+    }
+
+    printf("MSC Other($%02X)\n", scsi_cmd[0]);
 
     // Set Sense = Invalid Command Operation
     tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
@@ -26,6 +26,7 @@ specific language governing permissions and limitations under the License.
 
 static bool irqChannel1 = false;
 static bool irqShared = true;
+static void (*wait_hook)(void) = NULL;
 
 static void in_spi_irq_handler(const uint DMA_IRQ_num, io_rw_32 *dma_hw_ints_p) {
     for (size_t i = 0; i < spi_get_num(); ++i) {
@@ -54,6 +55,12 @@ void set_spi_dma_irq_channel(bool useChannel1, bool shared) {
     irqShared = shared;
 }
 
+// Called repeatedly while a block transfer is in flight. The hook must not
+// use the SPI bus (or anything that might, like FatFs).
+void set_spi_wait_hook(void (*hook)(void)) {
+    wait_hook = hook;
+}
+
 // SPI Transfer: Read & Write (simultaneously) on SPI bus
 //   If the data that will be received is not important, pass NULL as rx.
 //   If the data that will be transmitted is not important,
@@ -113,8 +120,23 @@ bool spi_transfer(spi_t *spi_p, const uint8_t *tx, uint8_t *rx, size_t length) {
 
     /* Wait until master completes transfer or time out has occured. */
     uint32_t timeOut = 1000; /* Timeout 1 sec */
-    bool rc = sem_acquire_timeout_ms(
-        &spi_p->sem, timeOut);  // Wait for notification from ISR
+    bool rc;
+    if (wait_hook && length >= 512) {
+        // Let the caller do other work during the data phase
+        static bool in_hook = false;
+        absolute_time_t timeout_time = make_timeout_time_ms(timeOut);
+        while (!(rc = sem_try_acquire(&spi_p->sem)) &&
+               0 < absolute_time_diff_us(get_absolute_time(), timeout_time)) {
+            if (!in_hook) {
+                in_hook = true;
+                wait_hook();
+                in_hook = false;
+            }
+        }
+    } else {
+        rc = sem_acquire_timeout_ms(
+            &spi_p->sem, timeOut);  // Wait for notification from ISR
+    }
     if (!rc) {
         // If the timeout is reached the function will return false
         DBG_PRINTF("Notification wait timed out in %s\n", __FUNCTION__);
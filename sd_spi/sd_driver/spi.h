@@ -64,6 +64,7 @@ void spi_lock(spi_t *pSPI);
 void spi_unlock(spi_t *pSPI);
 bool my_spi_init(spi_t *pSPI);
 void set_spi_dma_irq_channel(bool useChannel1, bool shared);
+void set_spi_wait_hook(void (*hook)(void));
 
 #ifdef __cplusplus
 }
@@ -24,12 +24,21 @@ SOFTWARE.
 
 */
 
+#include <pico/stdlib.h>
 #include <pico/multicore.h>
 #include <tusb.h>
 
 #include "ser.h"
 
+#define WRITE_TIMEOUT_MS    1000
+#define READ_IDLE_MS        10
+
+static bool claimed;    //  The SmartPort character unit owns the CDC stream
+
 void ser_task(void) {
+    if (claimed) {
+        return;
+    }
 
     while (true) {
         if (!multicore_fifo_wready()) {
@@ -51,3 +60,55 @@ void ser_task(void) {
     }
     tud_cdc_write_flush();
 }
+
+bool ser_open(void) {
+    claimed = true;
+    return tud_cdc_connected();
+}
+
+void ser_close(void) {
+    claimed = false;
+}
+
+uint16_t ser_read(uint8_t *data, uint16_t size) {
+    absolute_time_t timeout = make_timeout_time_ms(READ_IDLE_MS);
+    uint16_t read = 0;
+
+    //  The RX FIFO holds less than a full read, so keep draining it until
+    //  the host pauses
+    while (read < size && tud_cdc_connected()) {
+        uint32_t count = tud_cdc_read(&data[read], size - read);
+        read += count;
+        if (count) {
+            timeout = make_timeout_time_ms(READ_IDLE_MS);
+        } else {
+            if (absolute_time_diff_us(get_absolute_time(), timeout) <= 0) {
+                break;
+            }
+            tud_task();
+        }
+    }
+
+    return read;
+}
+
+uint16_t ser_write(const uint8_t *data, uint16_t size) {
+    absolute_time_t timeout = make_timeout_time_ms(WRITE_TIMEOUT_MS);
+    uint16_t written = 0;
+
+    while (written < size && tud_cdc_connected()) {
+        uint32_t count = tud_cdc_write(&data[written], size - written);
+        written += count;
+        if (!count) {
+            if (absolute_time_diff_us(get_absolute_time(), timeout) <= 0) {
+                break;
+            }
+            //  Make room in the TX FIFO
+            tud_cdc_write_flush();
+            tud_task();
+        }
+    }
+    tud_cdc_write_flush();
+
+    return written;
+}
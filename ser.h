@@ -29,4 +29,12 @@ SOFTWARE.
 
 void ser_task(void);
 
+bool ser_open(void);
+
+void ser_close(void);
+
+uint16_t ser_read(uint8_t *data, uint16_t size);
+
+uint16_t ser_write(const uint8_t *data, uint16_t size);
+
 #endif
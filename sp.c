@@ -29,9 +29,17 @@ SOFTWARE.
 #include <pico/stdlib.h>
 
 #include "board.h"
+#include "block_cache.h"
 #include "config.h"
 #include "hdd.h"
 #include "diskio.h"
+#include "freespace.h"
+#include "spi.h"
+#if MEDIUM == SD
+#include "ser.h"
+#elif MEDIUM == USB
+#include "copy.h"
+#endif
 
 #include "sp.h"
 
@@ -65,25 +73,106 @@ SOFTWARE.
 #define SP_O_RETVAL 0
 #define SP_O_BUFFER 1
 
+//  Block reads answer from offset 3, the 6502 reads the reply in sequence and
+//  the block lands word aligned, so block_copy can use DMA for it
+#define BLOCK_O_RETVAL  3
+#define BLOCK_O_BUFFER  4
+
 #define SP_PARAM_UNIT   0
 #define SP_PARAM_CODE   3
 #define SP_PARAM_BLOCK  3
+#define SP_PARAM_COUNT  3
 
 #define SP_STATUS_STS   0x00
 #define SP_STATUS_DCB   0x01
 #define SP_STATUS_NLS   0x02
 #define SP_STATUS_DIB   0x03
+#define SP_STATUS_STATS 0x40    //  A2retroNET counters (unit 0)
+#define SP_STATUS_GEN   0x41    //  A2retroNET content generation (unit n)
+
+#define SP_CONTROL_XFER     0x40    //  Select block read transfer method (unit 0)
+#define SP_CONTROL_STATS    0x41    //  Reset A2retroNET counters (unit 0)
+#define SP_CONTROL_SWAP     0x42    //  Put disk set member n in, $FF for the next one (unit n)
+#define SP_CONTROL_HOT      0x43    //  Write the block access estimates to <image>.hot (unit n)
+
+#define SP_XFER_PDMA    0x00
+#define SP_XFER_RDBUF   0x01
+#define SP_XFER_AUTO    0x02    //  The cheaper one for each block
+
+//  6502 cycles of a block transfer, at 1.023 MHz about one per microsecond
+#define CYCLES_RDBUF_READ   (512 * 15)  //  LDA DATA, STA (ADDRL),Y, INY, BNE
+#define CYCLES_RDBUF_WRITE  (512 * 14)  //  LDA (ADDRL),Y, STA DATA, INY, BNE
+#define CYCLES_PDMA_CALL    12          //  JSR PDMA, RTS
+#define CYCLES_PDMA_PAGE    5           //  NOPs and JMP $CB00 at the end of a code page
+#define US_TO_CYCLES(us)    ((us) * 1023 / 1000)
+#define PDMA_PROBE          16          //  Every nth block in a row sent via RDBUF compiles anyway
 
 #define SP_SUCCESS  0x00
 #define SP_BADCMD   0x01
 #define SP_BUSERR   0x06
 #define SP_BADCTL   0x21
+#define SP_IOERROR  0x27
+
+#if MEDIUM == SD
+#define SP_CHAR_UNITS   1       //  USB CDC stream, the unit after the drives
+#else
+#define SP_CHAR_UNITS   0
+#endif
+
+#define SP_CHAR_MAX     (SP_BUFFER_SIZE - SP_I_BUFFER)  //  Bytes per READ or WRITE
 
 volatile uint8_t  sp_control;
-volatile uint8_t  sp_buffer[1024];
+volatile uint8_t  sp_buffer[SP_BUFFER_SIZE] __attribute__((aligned(4)));
 volatile uint16_t sp_read_offset;
 volatile uint16_t sp_write_offset;
 
+#if FEATURE_A2F_PDMA
+static uint8_t sp_xfer_mode = SP_XFER_AUTO;
+#else
+static uint8_t sp_xfer_mode = SP_XFER_RDBUF;
+#endif
+
+static struct {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t errors;
+    uint32_t pdma;
+    uint32_t rdbuf;
+} sp_stats;
+
+//  Average compile times in us, the 6502 waits for them
+static uint32_t sp_compile_read_us = 0;
+static uint32_t sp_compile_write_us = 0;
+static uint8_t  sp_rdbuf_reads = 0;     //  In a row since the last compile
+static uint8_t  sp_rdbuf_writes = 0;
+
+static int sp_code = 0;             //  Code buffer the 6502 runs from
+static bool sp_idle = false;        //  In the idle path, no command is being worked on
+static uint32_t sp_urgent = 0;      //  board_urgent_events() already handled
+
+//  The next block of a sequential run, compiled into the other code buffer
+static struct {
+    bool     valid;                 //  Compiled and waiting for its read
+    bool     pending;               //  Worth compiling after the current read
+    uint8_t  drive;
+    uint16_t block;
+    uint16_t addr;
+    uint32_t generation;            //  hdd_generation() when the block was read
+    uint16_t stride;                //  6502 buffer step of the run, 0 or 512 mostly
+    bool     last_valid;
+    uint8_t  last_drive;
+    uint16_t last_block;
+    uint16_t last_addr;
+    uint32_t issued;
+    uint32_t hits;
+} spec = { .stride = 512 };
+
+static volatile bool sp_char_open = false;     //  Closed by a 6502 reset too
+
+static bool char_unit(uint8_t unit) {
+    return SP_CHAR_UNITS && unit == config_drives() + 1;
+}
+
 static uint8_t unit_to_drive(uint8_t unit) {
     uint8_t drive = unit >> 7;
     if ((unit >> 4 & 0x07) != board_slot()) {
@@ -97,6 +186,8 @@ void sp_init(void) {
 
     hdd_init();
 
+    set_spi_wait_hook(sp_poll);
+
 #ifdef PICO_DEFAULT_LED_PIN
     gpio_init(PICO_DEFAULT_LED_PIN);
     gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
@@ -115,16 +206,21 @@ uint16_t pd_buffer_addr = 0;
 #define INST_NOP        0xEA    
 #define INST_JMP        0x4C    //  + 2 byte addr
 #define INST_JMP_SIZE   3       //  1 + 2 byte addr
+#define INST_LDA        0xAD    //  + 2 byte addr
+#define INST_STA        0x8D    //  + 2 byte addr
 
 #define INST_BASE       0xCB00
 #define INST_BASE_LO    0x00
 #define INST_BASE_HI    0xCB
 
+#define INST_DATA_LO    0xF0    //  $CFF0, the DATA register
+#define INST_DATA_HI    0xCF
+
 #define INST_PAGE_BITS  8
 #define INST_PAGE_SIZE  (1L << INST_PAGE_BITS)
 
 
-int __time_critical_func(check_buffer_wrap)(int instruction_index, int next_instruction_size) {
+int __time_critical_func(check_buffer_wrap)(volatile uint8_t *code, int instruction_index, int next_instruction_size) {
     int current_page = instruction_index >> INST_PAGE_BITS;                     //  Divide by INST_PAGE_SIZE (256)
     int remaining = ((current_page + 1) << INST_PAGE_BITS) - (instruction_index + next_instruction_size + INST_JMP_SIZE);
 
@@ -135,26 +231,28 @@ int __time_critical_func(check_buffer_wrap)(int instruction_index, int next_inst
 
         //  fill in the last of this page
         while (instruction_index < nop_index_end) {
-            firmware_code_buffer[instruction_index++] = INST_NOP;
+            code[instruction_index++] = INST_NOP;
         }
 
         // The end of the buffer needs to jump to the begining to trigger a page switch
-        firmware_code_buffer[instruction_index++] = INST_JMP;
-        firmware_code_buffer[instruction_index++] = INST_BASE_LO;
-        firmware_code_buffer[instruction_index++] = INST_BASE_HI;
+        code[instruction_index++] = INST_JMP;
+        code[instruction_index++] = INST_BASE_LO;
+        code[instruction_index++] = INST_BASE_HI;
     }
 
     return instruction_index;
 }
 
 
-void __time_critical_func(sp_compile_buffer)(uint16_t a2_buffer_addr, uint8_t *in_buffer) {
-    int i = 0;
-    int current_page = 0;
+//  Point $CB00 at the start of a code buffer
+static void __time_critical_func(sp_map_code)(int buffer) {
+    firmware_map[SP_CODE_MAP1] = firmware_code_buffer[buffer];
+    firmware_map[SP_CODE_MAP2] = firmware_code_buffer[buffer];
+}
 
-    //  Reset the firmware pointer
-    firmware_map[SP_CODE_MAP1] = firmware_code_buffer;
-    firmware_map[SP_CODE_MAP2] = firmware_code_buffer;
+void __time_critical_func(sp_compile_buffer)(int buffer, uint16_t a2_buffer_addr, uint8_t *in_buffer) {
+    volatile uint8_t *code = firmware_code_buffer[buffer];
+    int i = 0;
 
     uint8_t last_value = 0;
 
@@ -168,23 +266,23 @@ void __time_critical_func(sp_compile_buffer)(uint16_t a2_buffer_addr, uint8_t *i
 
             //  Add a JMP if needed, do a quick check to see if we are close
             if ((i % INST_PAGE_SIZE) >= (INST_PAGE_SIZE - (5 + INST_JMP_SIZE)))      //  5 is next inst size
-                i = check_buffer_wrap(i, 5);
+                i = check_buffer_wrap(code, i, 5);
 
-            firmware_code_buffer[i++] = INST_LDY;
-            firmware_code_buffer[i++] = in_buffer[buffer_index];
+            code[i++] = INST_LDY;
+            code[i++] = in_buffer[buffer_index];
 
-            firmware_code_buffer[i++] = INST_STY;
-            firmware_code_buffer[i++] = addr_lo;
-            firmware_code_buffer[i++] = addr_hi;
+            code[i++] = INST_STY;
+            code[i++] = addr_lo;
+            code[i++] = addr_hi;
         } else {
             //  Add a JMP if needed, do a quick check to see if we are close
             if ((i % INST_PAGE_SIZE) >= (INST_PAGE_SIZE - (3 + INST_JMP_SIZE)))      //  3 is next inst size
-                i = check_buffer_wrap(i, 3);
+                i = check_buffer_wrap(code, i, 3);
 
             //  Emit a STY
-            firmware_code_buffer[i++] = INST_STY;
-            firmware_code_buffer[i++] = addr_lo;
-            firmware_code_buffer[i++] = addr_hi;
+            code[i++] = INST_STY;
+            code[i++] = addr_lo;
+            code[i++] = addr_hi;
         }
 
         last_value = value;
@@ -193,12 +291,39 @@ void __time_critical_func(sp_compile_buffer)(uint16_t a2_buffer_addr, uint8_t *i
     }
 
     //  Terminate with an RTS
-    i = check_buffer_wrap(i, 1);
-    firmware_code_buffer[i++] = INST_RTS;
+    i = check_buffer_wrap(code, i, 1);
+    code[i++] = INST_RTS;
+}
+
+//  Compiled code for write transfers, LDA abs / STA DATA for every byte of the Apple II buffer
+void __time_critical_func(sp_compile_write)(int buffer, uint16_t a2_buffer_addr) {
+    volatile uint8_t *code = firmware_code_buffer[buffer];
+    int i = 0;
+
+    for (int buffer_index = 0; buffer_index < 512; buffer_index++) {
+        //  Add a JMP if needed, do a quick check to see if we are close
+        if ((i % INST_PAGE_SIZE) >= (INST_PAGE_SIZE - (6 + INST_JMP_SIZE)))      //  6 is next inst pair size
+            i = check_buffer_wrap(code, i, 6);
+
+        code[i++] = INST_LDA;
+        code[i++] = a2_buffer_addr & 0xFF;
+        code[i++] = (a2_buffer_addr >> 8) & 0xFF;
+
+        code[i++] = INST_STA;
+        code[i++] = INST_DATA_LO;
+        code[i++] = INST_DATA_HI;
+
+        a2_buffer_addr++;
+    }
+
+    //  Terminate with an RTS
+    i = check_buffer_wrap(code, i, 1);
+    code[i++] = INST_RTS;
 }
 
 void __time_critical_func(sp_reset)(void) {
     sp_control = CONTROL_NONE;
+    sp_char_open = false;
     sp_read_offset = sp_write_offset = 0;
     sp_buffer[0] = sp_buffer[1] = 0;
 }
@@ -207,14 +332,50 @@ static uint8_t sp_stat(uint8_t *params, uint8_t *stat_list) {
     if (!params[SP_PARAM_UNIT]) {
         if (params[SP_PARAM_CODE] == SP_STATUS_STS) {
             printf("SP CmdStatus(Device=Smartport)\n");
-            stat_list[2 + 0] = config_drives();
+            stat_list[2 + 0] = config_drives() + SP_CHAR_UNITS;
             stat_list[2 + 1] = 0b01000000;  // no interrupt sent
             memset(&stat_list[2 + 2], 0x00, 6);
             stat_list[0] = 8;   // size header low
             stat_list[1] = 0;   // size header high
+        } else if (params[SP_PARAM_CODE] == SP_STATUS_STATS) {
+            uint32_t counters[10];
+            counters[0] = time_us_32();
+            counters[1] = sp_stats.reads;
+            counters[2] = sp_stats.writes;
+            counters[3] = sp_stats.errors;
+            counters[4] = sp_stats.pdma;
+            counters[5] = sp_stats.rdbuf;
+            block_cache_get_stats(&counters[6], &counters[7]);
+            counters[8] = spec.hits;
+            counters[9] = sp_compile_read_us;
+            memcpy(&stat_list[2], counters, sizeof(counters));      // little-endian
+            stat_list[0] = sizeof(counters);    // size header low
+            stat_list[1] = 0;                   // size header high
         } else {
             return SP_BADCTL;
         }
+    } else if (char_unit(params[SP_PARAM_UNIT])) {
+        if (params[SP_PARAM_CODE] != SP_STATUS_STS &&
+            params[SP_PARAM_CODE] != SP_STATUS_DIB) {
+            return SP_BADCTL;
+        }
+        stat_list[2 + 0] = sp_char_open
+                         ? 0b01110001   // character, write, read, online, open
+                         : 0b01110000;  // character, write, read, online
+        memset(&stat_list[2 + 1], 0x00, 3);     // no blocks
+        if (params[SP_PARAM_CODE] == SP_STATUS_STS) {
+            stat_list[0] = 4;   // size header low
+            stat_list[1] = 0;   // size header high
+        } else {
+            stat_list[2 +  4] = 0x0E;   // id string length
+            memcpy(&stat_list[2 + 5], "A2RETRONET CDC  ", 16);
+            stat_list[2 + 21] = 0x0F;   // modem
+            stat_list[2 + 22] = 0x00;   // subtype
+            stat_list[2 + 23] = 0x01;   // firmware version low
+            stat_list[2 + 24] = 0x00;   // firmware version high
+            stat_list[0] = 25;  // size header low
+            stat_list[1] = 0;   // size header high
+        }
     } else {
         if (params[SP_PARAM_CODE] == SP_STATUS_STS ||
             params[SP_PARAM_CODE] == SP_STATUS_DIB) {
@@ -242,6 +403,12 @@ static uint8_t sp_stat(uint8_t *params, uint8_t *stat_list) {
                 stat_list[0] = 25;  // size header low
                 stat_list[1] = 0;   // size header high    
             }
+        } else if (params[SP_PARAM_CODE] == SP_STATUS_GEN) {
+            //  Changes on every write and image change, lets the host validate its own block copies
+            uint32_t gen = hdd_generation(params[SP_PARAM_UNIT] - 1);
+            memcpy(&stat_list[2], &gen, sizeof(gen));      // little-endian
+            stat_list[0] = sizeof(gen);     // size header low
+            stat_list[1] = 0;               // size header high
         } else {
             return SP_BADCTL;
         }
@@ -249,6 +416,248 @@ static uint8_t sp_stat(uint8_t *params, uint8_t *stat_list) {
     return SP_SUCCESS;
 }
 
+static uint8_t sp_ctrl(uint8_t *params, const uint8_t *ctrl_list) {
+    if (params[SP_PARAM_UNIT]) {
+        if (params[SP_PARAM_CODE] == SP_CONTROL_SWAP && !char_unit(params[SP_PARAM_UNIT]) &&
+            hdd_swap(params[SP_PARAM_UNIT] - 1, ctrl_list[0])) {
+            return SP_SUCCESS;
+        }
+        if (params[SP_PARAM_CODE] == SP_CONTROL_HOT && !char_unit(params[SP_PARAM_UNIT])) {
+            return hdd_dump_hot(params[SP_PARAM_UNIT] - 1) ? SP_SUCCESS : SP_IOERROR;
+        }
+        return SP_BADCTL;
+    }
+    switch (params[SP_PARAM_CODE]) {
+        case SP_CONTROL_XFER:
+            if (ctrl_list[0] > SP_XFER_AUTO) {
+                return SP_BADCTL;
+            }
+#if FEATURE_A2F_PDMA
+            sp_xfer_mode = ctrl_list[0];
+#endif
+            printf("SP Transfer(Mode=%d)\n", sp_xfer_mode);
+            return SP_SUCCESS;
+        case SP_CONTROL_STATS:
+            memset(&sp_stats, 0, sizeof(sp_stats));
+            return SP_SUCCESS;
+    }
+    return SP_BADCTL;
+}
+
+#if FEATURE_A2F_PDMA
+static uint32_t average_us(uint32_t average, uint32_t us) {
+    return average ? (average * 7 + us) / 8 : us;
+}
+
+//  LDY #/STY abs for a new value, STY abs for a repeated one, like sp_compile_buffer()
+static uint32_t pdma_read_cycles(const uint8_t *data) {
+    uint32_t changes = 1;
+    for (int i = 1; i < 512; i++) {
+        if (data[i] != data[i - 1]) {
+            changes++;
+        }
+    }
+    uint32_t code = changes * 5 + (512 - changes) * 3;
+    return CYCLES_PDMA_CALL + changes * 6 + (512 - changes) * 4 + code / INST_PAGE_SIZE * CYCLES_PDMA_PAGE;
+}
+
+//  Compiling only pays if it and the compiled code are faster than the RDBUF loop
+static bool pdma_read_pays(const uint8_t *data) {
+    if (sp_xfer_mode != SP_XFER_AUTO) {
+        return sp_xfer_mode == SP_XFER_PDMA;
+    }
+    //  Only a compile updates the average, one slow compile mustn't keep PDMA off for good
+    if (US_TO_CYCLES(sp_compile_read_us) + pdma_read_cycles(data) < CYCLES_RDBUF_READ ||
+        ++sp_rdbuf_reads == PDMA_PROBE) {
+        sp_rdbuf_reads = 0;
+        return true;
+    }
+    return false;
+}
+
+//  LDA abs/STA DATA, 4 + 4 cycles for every byte, like sp_compile_write()
+static bool pdma_write_pays(void) {
+    if (sp_xfer_mode != SP_XFER_AUTO) {
+        return sp_xfer_mode == SP_XFER_PDMA;
+    }
+    uint32_t cycles = CYCLES_PDMA_CALL + 512 * 8 + 512 * 6 / INST_PAGE_SIZE * CYCLES_PDMA_PAGE;
+    if (US_TO_CYCLES(sp_compile_write_us) + cycles < CYCLES_RDBUF_WRITE || ++sp_rdbuf_writes == PDMA_PROBE) {
+        sp_rdbuf_writes = 0;
+        return true;
+    }
+    return false;
+}
+#endif
+
+//  Prepare the 6502 side of a block read, returns the completion control value
+static uint8_t sp_read_transfer(uint8_t retval, uint16_t a2_buffer_addr, uint8_t *data) {
+    sp_stats.reads++;
+    if (retval) {
+        sp_stats.errors++;
+    }
+
+#if FEATURE_A2F_PDMA
+    if (pdma_read_pays(data)) {
+        uint32_t start = time_us_32();
+        sp_compile_buffer(sp_code, a2_buffer_addr, data);
+        sp_map_code(sp_code);
+        sp_compile_read_us = average_us(sp_compile_read_us, time_us_32() - start);
+        sp_stats.pdma++;
+        return CONTROL_DONE;
+    }
+#endif
+    sp_stats.rdbuf++;
+    return CONTROL_DONE | CONTROL_RDBUF;
+}
+
+//  Prepare the 6502 side of a block write, returns the completion control value
+static uint8_t sp_write_transfer(uint16_t a2_buffer_addr) {
+#if FEATURE_A2F_PDMA
+    if (pdma_write_pays()) {
+        uint32_t start = time_us_32();
+        sp_compile_write(sp_code, a2_buffer_addr);
+        sp_map_code(sp_code);
+        sp_compile_write_us = average_us(sp_compile_write_us, time_us_32() - start);
+        sp_stats.pdma++;
+        return CONTROL_DONE;
+    }
+#endif
+    sp_stats.rdbuf++;
+    return CONTROL_DONE | CONTROL_RDBUF;
+}
+
+//  Is this read already compiled in the other code buffer?
+static bool spec_matches(uint8_t drive, uint16_t block, uint16_t a2_buffer_addr) {
+#if FEATURE_A2F_PDMA
+    return spec.valid && sp_xfer_mode != SP_XFER_RDBUF &&
+           spec.drive == drive && spec.block == block && spec.addr == a2_buffer_addr &&
+           spec.generation == hdd_generation(drive);
+#else
+    return false;
+#endif
+}
+
+//  Read a block for the 6502, returns the completion control value
+static uint8_t sp_read(uint8_t drive, uint16_t block, uint16_t a2_buffer_addr, uint8_t *data, volatile uint8_t *retval) {
+    uint8_t done;
+
+#if FEATURE_A2F_PDMA
+    if (spec_matches(drive, block, a2_buffer_addr)) {
+        //  Already compiled, just switch buffers
+        sp_code ^= 1;
+        sp_map_code(sp_code);
+        hdd_served(drive, block);
+        sp_stats.reads++;
+        sp_stats.pdma++;
+        spec.hits++;
+        *retval = SP_SUCCESS;
+        done = CONTROL_DONE;
+    } else
+#endif
+    {
+        *retval = hdd_read(drive, block, data);
+        done = sp_read_transfer(*retval, a2_buffer_addr, data);
+    }
+    spec.valid = false;
+
+    //  Only runs of sequential blocks are followed
+    bool sequential = spec.last_valid && spec.last_drive == drive && (uint16_t)(spec.last_block + 1) == block;
+    if (sequential) {
+        spec.stride = a2_buffer_addr - spec.last_addr;
+    }
+    spec.pending = sequential && *retval == SP_SUCCESS;
+    spec.last_valid = true;
+    spec.last_drive = drive;
+    spec.last_block = block;
+    spec.last_addr = a2_buffer_addr;
+
+    return done;
+}
+
+//  Compile the next block of a run while the 6502 runs the current one
+static bool sp_speculate(void) {
+#if FEATURE_A2F_PDMA
+    //  Compiled in idle time, PDMA always pays then
+    if (!spec.pending || sp_xfer_mode == SP_XFER_RDBUF) {
+        return false;
+    }
+    spec.pending = false;
+
+    static uint8_t data[512];
+    uint8_t  drive = spec.last_drive;
+    uint16_t block = spec.last_block + 1;
+    uint32_t generation = hdd_generation(drive);
+
+    if (hdd_read_ahead(drive, block, data)) {
+        return true;
+    }
+    sp_compile_buffer(sp_code ^ 1, spec.last_addr + spec.stride, data);
+
+    spec.drive = drive;
+    spec.block = block;
+    spec.addr = spec.last_addr + spec.stride;
+    spec.generation = generation;
+    spec.valid = true;
+    spec.issued++;
+    return true;
+#else
+    return false;
+#endif
+}
+
+//  Runs while the SD card transfers a block, answers a read that is already
+//  compiled. Only background transfers are split like that, the transfer of a
+//  command is the one the 6502 is waiting for
+void sp_poll(void) {
+    if (!sp_idle || !spec.valid) {
+        return;
+    }
+
+    uint8_t drive;
+    uint16_t block;
+    switch (sp_control) {
+        case CONTROL_PRODOS:
+            if (sp_buffer[PRODOS_I_CMD] != PRODOS_CMD_READ) {
+                return;
+            }
+            drive = unit_to_drive(sp_buffer[PRODOS_I_UNIT]);
+            block = *(uint16_t*)&sp_buffer[PRODOS_I_BLOCK];
+            break;
+        case CONTROL_SP:
+            if (sp_buffer[SP_I_CMD] != SP_CMD_READBLK) {
+                return;
+            }
+            drive = sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT] - 1;
+            block = *(uint16_t*)&sp_buffer[SP_I_PARAMS + SP_PARAM_BLOCK];
+            break;
+        default:
+            return;
+    }
+
+    uint16_t a2_buffer_address = (uint16_t)(((uint16_t)sp_address_high << 8) | sp_address_low);     //  SMARTPORT.S fills this in
+    if (!spec_matches(drive, block, a2_buffer_address)) {
+        return;
+    }
+    pd_buffer_addr = a2_buffer_address;
+
+    uint8_t done = sp_read(drive, block, a2_buffer_address, NULL, &sp_buffer[BLOCK_O_RETVAL]);
+    //  Reset the address
+    sp_address_low = 0;
+    sp_address_high = 0;
+
+    sp_read_offset = BLOCK_O_RETVAL;
+    sp_write_offset = 0;
+    sp_control = done;
+}
+
+static uint8_t sp_write_done(uint8_t retval) {
+    sp_stats.writes++;
+    if (retval) {
+        sp_stats.errors++;
+    }
+    return retval;
+}
+
 static uint8_t sp_readblk(uint8_t *params, uint8_t *buffer) {
     return hdd_read(params[SP_PARAM_UNIT] - 1, *(uint16_t*)&params[SP_PARAM_BLOCK], buffer);
 }
@@ -257,10 +666,92 @@ static uint8_t sp_writeblk(uint8_t *params, const uint8_t *buffer) {
     return hdd_write(params[SP_PARAM_UNIT] - 1, *(uint16_t*)&params[SP_PARAM_BLOCK], buffer);
 }
 
+static uint8_t sp_open(uint8_t *params, bool open) {
+    if (!char_unit(params[SP_PARAM_UNIT])) {
+        return SP_BADCMD;
+    }
+#if MEDIUM == SD
+    if (open) {
+        ser_open();
+    } else {
+        ser_close();
+    }
+#endif
+    sp_char_open = open;
+    return SP_SUCCESS;
+}
+
+//  Returns what the CDC stream delivers until it pauses, the 6502 reads the
+//  byte count first
+static uint8_t sp_read_chars(uint8_t *params, uint8_t *buffer) {
+    if (!char_unit(params[SP_PARAM_UNIT])) {
+        return SP_BADCMD;
+    }
+    if (!sp_char_open) {
+        return SP_IOERROR;
+    }
+
+    uint16_t count = *(uint16_t*)&params[SP_PARAM_COUNT];
+    if (count > SP_CHAR_MAX) {
+        count = SP_CHAR_MAX;
+    }
+#if MEDIUM == SD
+    count = ser_read(&buffer[2], count);
+#endif
+    buffer[0] = count % 0x100;
+    buffer[1] = count / 0x100;
+    return SP_SUCCESS;
+}
+
+static uint8_t sp_write_chars(uint8_t *params, const uint8_t *buffer) {
+    if (!char_unit(params[SP_PARAM_UNIT])) {
+        return SP_BADCMD;
+    }
+
+    uint16_t count = *(uint16_t*)&params[SP_PARAM_COUNT];
+    if (!sp_char_open || count > SP_CHAR_MAX) {
+        return SP_IOERROR;
+    }
+#if MEDIUM == SD
+    if (ser_write(buffer, count) != count) {
+        return SP_IOERROR;
+    }
+#endif
+    return SP_SUCCESS;
+}
+
 void sp_task(void) {
+    //  Ctrl-Reset or power fail, nothing goes before writing back the cache
+    if (board_urgent_events() != sp_urgent) {
+        sp_urgent = board_urgent_events();
+        disk_flush_urgent();
+    }
+
+    if (sp_control == CONTROL_NONE || sp_control & CONTROL_DONE) {
+#if MEDIUM == SD
+        if (!sp_char_open) {
+            ser_close();    //  Back to the SSC
+        }
+#endif
+        sp_idle = true;
+        if (!sp_speculate()
+#if MEDIUM == USB
+            && !copy_task()
+#endif
+            && !hdd_task()
+            && !disk_task()) {
+            freespace_task();
+        }
+        sp_idle = false;
+        return;
+    }
 
-    if (sp_control == CONTROL_NONE || sp_control == CONTROL_DONE) {
-        disk_task();
+    //  Not a command, the command bytes already written to DATA are kept
+    if (sp_control == CONTROL_PDMAWR) {
+        sp_control = sp_write_transfer((uint16_t)(((uint16_t)sp_address_high << 8) | sp_address_low));     //  SMARTPORT.S fills this in
+        //  Reset the address
+        sp_address_low = 0;
+        sp_address_high = 0;
         return;
     }
 
@@ -277,6 +768,13 @@ void sp_task(void) {
     gpio_put(PICO_DEFAULT_LED_PIN, true);
 #endif
 
+#if MEDIUM == USB
+    copy_throttle();
+#endif
+
+    uint8_t done = CONTROL_DONE;
+    uint16_t reply = 0;
+
 //    printf("SP Cmd(Type=$%02X,Bytes=$%04X)\n", sp_control, sp_write_offset);
     switch (sp_control) {
 
@@ -290,20 +788,20 @@ void sp_task(void) {
                     uint16_t a2_buffer_address = (uint16_t)(((uint16_t)sp_address_high << 8) | sp_address_low);     //  SMARTPORT.S fills this in
                     pd_buffer_addr = a2_buffer_address;
 
-                    sp_buffer[PRODOS_O_RETVAL] = hdd_read(unit_to_drive(sp_buffer[PRODOS_I_UNIT]),
-                                                          *(uint16_t*)&sp_buffer[PRODOS_I_BLOCK],
-                                                          (uint8_t*)&sp_buffer[PRODOS_O_BUFFER]);
-#if FEATURE_A2F_PDMA
-                    sp_compile_buffer(a2_buffer_address, (uint8_t*)&sp_buffer[PRODOS_O_BUFFER]);
-#endif
+                    done = sp_read(unit_to_drive(sp_buffer[PRODOS_I_UNIT]),
+                                   *(uint16_t*)&sp_buffer[PRODOS_I_BLOCK],
+                                   a2_buffer_address,
+                                   (uint8_t*)&sp_buffer[BLOCK_O_BUFFER],
+                                   &sp_buffer[BLOCK_O_RETVAL]);
+                    reply = BLOCK_O_RETVAL;
                     //  Reset the address
                     sp_address_low = 0;
                     sp_address_high = 0;
                     break;
                 case PRODOS_CMD_WRITE:
-                    sp_buffer[PRODOS_O_RETVAL] = hdd_write(unit_to_drive(sp_buffer[PRODOS_I_UNIT]),
-                                                           *(uint16_t*)&sp_buffer[PRODOS_I_BLOCK],
-                                                           (uint8_t*)&sp_buffer[PRODOS_I_BUFFER]);
+                    sp_buffer[PRODOS_O_RETVAL] = sp_write_done(hdd_write(unit_to_drive(sp_buffer[PRODOS_I_UNIT]),
+                                                                         *(uint16_t*)&sp_buffer[PRODOS_I_BLOCK],
+                                                                         (uint8_t*)&sp_buffer[PRODOS_I_BUFFER]));
                     break;
                 default:
                     printf("SP NO PD COMMAND\n");
@@ -322,26 +820,33 @@ void sp_task(void) {
                     break;
                 case SP_CMD_READBLK:
 //                    printf("SP CmdReadBlock(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
+                    if (char_unit(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT])) {
+                        sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+                        break;
+                    }
                     uint16_t a2_buffer_address = (uint16_t)(((uint16_t)sp_address_high << 8) | sp_address_low);     //  SMARTPORT.S fills this in
                     pd_buffer_addr = a2_buffer_address;
 
-                    sp_buffer[SP_O_RETVAL] = hdd_read(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT] - 1, 
-                                                        *(uint16_t*)&sp_buffer[SP_I_PARAMS + SP_PARAM_BLOCK], 
-                                                        (uint8_t*)&sp_buffer[SP_O_BUFFER]);
-
-#if FEATURE_A2F_PDMA
-                    sp_compile_buffer(a2_buffer_address, (uint8_t*)&sp_buffer[SP_O_BUFFER]);
-#endif
+                    done = sp_read(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT] - 1,
+                                   *(uint16_t*)&sp_buffer[SP_I_PARAMS + SP_PARAM_BLOCK],
+                                   a2_buffer_address,
+                                   (uint8_t*)&sp_buffer[BLOCK_O_BUFFER],
+                                   &sp_buffer[BLOCK_O_RETVAL]);
+                    reply = BLOCK_O_RETVAL;
                     //  Reset the address
                     sp_address_low = 0;
                     sp_address_high = 0;
                     break;
                 case SP_CMD_WRITEBLK:
 //                    printf("SP CmdWriteBlock(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-
-                    sp_buffer[SP_O_RETVAL] = hdd_write(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT] - 1, 
-                                                        *(uint16_t*)&sp_buffer[SP_I_PARAMS + SP_PARAM_BLOCK], 
-                                                        (uint8_t*)&sp_buffer[SP_I_BUFFER]);
+                    if (char_unit(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT])) {
+                        sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+                        break;
+                    }
+
+                    sp_buffer[SP_O_RETVAL] = sp_write_done(hdd_write(sp_buffer[SP_I_PARAMS + SP_PARAM_UNIT] - 1, 
+                                                                     *(uint16_t*)&sp_buffer[SP_I_PARAMS + SP_PARAM_BLOCK], 
+                                                                     (uint8_t*)&sp_buffer[SP_I_BUFFER]));
                     break;
                 case SP_CMD_FORMAT:
                     printf("SP CmdFormat(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
@@ -349,7 +854,8 @@ void sp_task(void) {
                     break;
                 case SP_CMD_CONTROL:
                     printf("SP CmdControl(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-                    sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+                    sp_buffer[SP_O_RETVAL] = sp_ctrl((uint8_t*)&sp_buffer[SP_I_PARAMS],
+                                                     (uint8_t*)&sp_buffer[SP_I_BUFFER]);
                     break;
                 case SP_CMD_INIT:
                     printf("SP CmdInit(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
@@ -357,19 +863,21 @@ void sp_task(void) {
                     break;
                 case SP_CMD_OPEN:
                     printf("SP CmdOpen(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-                    sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+                    sp_buffer[SP_O_RETVAL] = sp_open((uint8_t*)&sp_buffer[SP_I_PARAMS], true);
                     break;
                 case SP_CMD_CLOSE:
                     printf("SP CmdClose(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-                    sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+                    sp_buffer[SP_O_RETVAL] = sp_open((uint8_t*)&sp_buffer[SP_I_PARAMS], false);
                     break;
                 case SP_CMD_READ:
-                    printf("SP CmdRead(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-                    sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+//                    printf("SP CmdRead(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
+                    sp_buffer[SP_O_RETVAL] = sp_read_chars((uint8_t*)&sp_buffer[SP_I_PARAMS],
+                                                           (uint8_t*)&sp_buffer[SP_O_BUFFER]);
                     break;
                 case SP_CMD_WRITE:
-                    printf("SP CmdWrite(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
-                    sp_buffer[SP_O_RETVAL] = SP_BADCMD;
+//                    printf("SP CmdWrite(Device=$%02X)\n", sp_buffer[SP_I_PARAMS]);
+                    sp_buffer[SP_O_RETVAL] = sp_write_chars((uint8_t*)&sp_buffer[SP_I_PARAMS],
+                                                            (uint8_t*)&sp_buffer[SP_I_BUFFER]);
                     break;
                 default:
                     printf("SP NO SP COMMAND\n");
@@ -378,10 +886,21 @@ void sp_task(void) {
             break;
     }
 
-    sp_read_offset = sp_write_offset = 0;
-    sp_control = CONTROL_DONE;
+    sp_read_offset = reply;
+    sp_write_offset = 0;
+    sp_control = done;
 
 #ifdef PICO_DEFAULT_LED_PIN
     gpio_put(PICO_DEFAULT_LED_PIN, false);
 #endif
 }
+
+void sp_print_stats(void) {
+#if IO_STATS
+    if (spec.issued) {
+        printf("sp:, Speculated, %lu, Hit, %lu,\n", spec.issued, spec.hits);
+    }
+    printf("sp:, PDMA, %lu, RDBUF, %lu, Compile Read us, %lu, Write us, %lu,\n",
+        sp_stats.pdma, sp_stats.rdbuf, sp_compile_read_us, sp_compile_write_us);
+#endif
+}
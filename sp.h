@@ -30,11 +30,16 @@ SOFTWARE.
 #define CONTROL_NONE    0x00
 #define CONTROL_PRODOS  0x01
 #define CONTROL_SP      0x02
+#define CONTROL_PDMAWR  0x04    //  Compile the write transfer for PSDMA, keeps DATA offsets
 #define CONTROL_CONFIG  0x40
 #define CONTROL_DONE    0x80
 
+#define CONTROL_RDBUF   0x01    //  With CONTROL_DONE: transfer block via DATA instead of PDMA
+
+#define SP_BUFFER_SIZE  4096    //  Power of 2, DATA offsets wrap around
+
 extern volatile uint8_t  sp_control;
-extern volatile uint8_t  sp_buffer[1024];
+extern volatile uint8_t  sp_buffer[SP_BUFFER_SIZE];
 extern volatile uint16_t sp_read_offset;
 extern volatile uint16_t sp_write_offset;
 
@@ -44,4 +49,8 @@ void sp_reset(void);
 
 void sp_task(void);
 
+void sp_poll(void);
+
+void sp_print_stats(void);
+
 #endif
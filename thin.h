@@ -0,0 +1,60 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef _THIN_H
+#define _THIN_H
+
+#include <stdint.h>
+
+/*
+
+Thin image (.tpo) layout, all values little-endian:
+
+    0                   thin_header, padded to THIN_HEADER_SIZE
+    THIN_HEADER_SIZE    block map, one uint16_t per volume block, padded to 512
+    data_offset         data slots, 512 bytes each, in allocation order
+
+A map entry of 0 means the block was never written and reads as zeros,
+entry n means the block lives in slot n at data_offset + (n - 1) * 512.
+Slots are appended on the first non-zero write of a block.
+
+*/
+
+#define THIN_MAGIC          "A2TP"
+#define THIN_VERSION        1
+#define THIN_HEADER_SIZE    512
+#define THIN_MAX_BLOCKS     0xFFFF
+
+#define THIN_MAP_SIZE(blocks)   (((uint32_t)(blocks) * 2 + 511) & ~511)
+
+typedef struct {
+    char     magic[4];
+    uint16_t version;
+    uint16_t blocks;            //  Volume size presented to ProDOS
+    uint32_t data_offset;       //  THIN_HEADER_SIZE + THIN_MAP_SIZE(blocks)
+} thin_header;
+
+#endif //   _THIN_H
\ No newline at end of file
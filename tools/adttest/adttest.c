@@ -0,0 +1,365 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/*
+
+Replays an ADTPro session against adt.c on the host, no Apple II or card needed.
+
+    cc -I. -I../.. -I../../fatfs/source -I../../sd_spi/include -o adttest adttest.c
+    adttest session.txt
+
+A session is a list of lines, # starts a comment:
+
+    file PATH BLOCKS        a disk image filled with test data
+    dir PATH                a directory
+    > bytes                 sent by the client
+    < bytes                 expected from the card next
+    check PATH BLOCKS       the disk image now holds the test data
+    full                    writes come up short from now on
+    wait MS                 time passes without the client sending
+
+Bytes are hex values or 'text', which stands for its characters with the
+high bit set. After each > line adt_task() runs until the card is quiet,
+at the end nothing may be left over in either direction. Files only live
+in memory.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../../adt.c"
+
+#define MAX_FILES   16
+#define MAX_BYTES   65536
+
+static struct {
+    char     path[MAX_PATH];
+    bool     dir;
+    uint8_t *data;
+    FSIZE_t  size;
+} files[MAX_FILES];
+static int file_count;
+
+static uint8_t input[MAX_BYTES];
+static int input_head, input_tail;
+static uint8_t output[MAX_BYTES];
+static int output_head, output_tail;
+static absolute_time_t now;
+static bool full;
+
+static char listing[MAX_PATH];     //  adt.c has one directory open at a time
+
+//  Runs of equal bytes and changing ones, both sides of the XOR encoding
+static uint8_t pattern(FSIZE_t offset) {
+    uint32_t block = offset / ADT_BLOCK;
+    uint32_t i = offset % ADT_BLOCK;
+    if (i < 100) {
+        return 0x00;
+    }
+    if (i < 200) {
+        return 0xE5;
+    }
+    return (block * 31 + i * 7) & 0xFF;
+}
+
+absolute_time_t get_absolute_time(void) {
+    return now;
+}
+
+absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return now + ms * 1000ull;
+}
+
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to - from);
+}
+
+bool multicore_fifo_wready(void) {
+    return output_head < MAX_BYTES;
+}
+
+void multicore_fifo_push_blocking(uint32_t data) {
+    output[output_head++] = data;
+}
+
+bool multicore_fifo_rvalid(void) {
+    return input_tail < input_head;
+}
+
+uint32_t multicore_fifo_pop_blocking(void) {
+    return input[input_tail++];
+}
+
+bool config_adtpro(void) {
+    return true;
+}
+
+void hdd_reset(void) {
+}
+
+DRESULT disk_flush(void) {
+    return RES_OK;
+}
+
+const char *FRESULT_str(FRESULT i) {
+    return "error";
+}
+
+static int find(const char *path) {
+    for (int i = 0; i < file_count; i++) {
+        if (!strcmp(files[i].path, path[0] ? path : "/")) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add(const char *path, bool dir) {
+    if (file_count == MAX_FILES) {
+        fprintf(stderr, "too many files\n");
+        exit(1);
+    }
+    snprintf(files[file_count].path, MAX_PATH, "%s", path);
+    files[file_count].dir = dir;
+    files[file_count].data = NULL;
+    files[file_count].size = 0;
+    return file_count++;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+    int i = find(path);
+    if (mode & FA_CREATE_ALWAYS) {
+        if (i < 0) {
+            i = add(path, false);
+        }
+        free(files[i].data);
+        files[i].data = NULL;
+        files[i].size = 0;
+    }
+    if (i < 0 || files[i].dir) {
+        return FR_NO_FILE;
+    }
+    memset(fp, 0, sizeof(FIL));
+    fp->obj.id = i;
+    fp->obj.objsize = files[i].size;
+    return FR_OK;
+}
+
+FRESULT f_close(FIL *fp) {
+    return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+    FSIZE_t left = files[fp->obj.id].size - fp->fptr;
+    *br = btr < left ? btr : left;
+    memcpy(buff, &files[fp->obj.id].data[fp->fptr], *br);
+    fp->fptr += *br;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw) {
+    if (full) {
+        *bw = 0;
+        return FR_OK;
+    }
+    files[fp->obj.id].data = realloc(files[fp->obj.id].data, fp->fptr + btw);
+    memcpy(&files[fp->obj.id].data[fp->fptr], buff, btw);
+    fp->fptr += btw;
+    files[fp->obj.id].size = fp->obj.objsize = fp->fptr;
+    *bw = btw;
+    return FR_OK;
+}
+
+FRESULT f_stat(const TCHAR *path, FILINFO *fno) {
+    int i = find(path);
+    if (i < 0) {
+        return FR_NO_FILE;
+    }
+    fno->fsize = files[i].size;
+    fno->fattrib = files[i].dir ? AM_DIR : 0;
+    return FR_OK;
+}
+
+FRESULT f_opendir(DIR *dp, const TCHAR *path) {
+    int i = find(path);
+    if (i < 0 || !files[i].dir) {
+        return FR_NO_PATH;
+    }
+    snprintf(listing, MAX_PATH, "%s", strcmp(path, "/") ? path : "");
+    dp->dptr = 0;
+    return FR_OK;
+}
+
+FRESULT f_readdir(DIR *dp, FILINFO *fno) {
+    size_t length = strlen(listing);
+    while (dp->dptr < (DWORD)file_count) {
+        const char *path = files[dp->dptr++].path;
+        if (!strncmp(path, listing, length) && path[length] == '/' && path[length + 1] &&
+            !strchr(&path[length + 1], '/')) {
+            f_stat(path, fno);
+            snprintf(fno->fname, sizeof(fno->fname), "%s", &path[length + 1]);
+            return FR_OK;
+        }
+    }
+    fno->fname[0] = '\0';
+    return FR_OK;
+}
+
+FRESULT f_closedir(DIR *dp) {
+    return FR_OK;
+}
+
+//  Hex values and 'text' with the high bit set, returns the number of bytes
+static int parse(const char *text, uint8_t *bytes, int line) {
+    int count = 0;
+    while (*text) {
+        if (isspace((unsigned char)*text)) {
+            text++;
+        } else if (*text == '\'') {
+            for (text++; *text && *text != '\''; text++) {
+                bytes[count++] = *text | 0x80;
+            }
+            if (*text++ != '\'') {
+                fprintf(stderr, "line %d: unterminated text\n", line);
+                exit(1);
+            }
+        } else {
+            char *end;
+            unsigned long value = strtoul(text, &end, 16);
+            if (end == text || value > 0xFF) {
+                fprintf(stderr, "line %d: bad byte\n", line);
+                exit(1);
+            }
+            bytes[count++] = value;
+            text = end;
+        }
+    }
+    return count;
+}
+
+static void run(void) {
+    //  Lets the card drain its output queue, every call is a poll of the register
+    for (int i = 0; i < 16; i++) {
+        adt_task();
+        now += 1000;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <session.txt>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *session = fopen(argv[1], "r");
+    if (!session) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    add("/", true);
+
+    static char text[MAX_BYTES * 3];
+    static uint8_t bytes[MAX_BYTES];
+    int line = 0;
+    int failed = 0;
+    while (fgets(text, sizeof(text), session)) {
+        line++;
+        char *comment = strchr(text, '#');
+        if (comment && !memchr(text, '\'', comment - text)) {
+            *comment = '\0';
+        }
+
+        char path[MAX_PATH];
+        unsigned blocks;
+        unsigned ms;
+        if (sscanf(text, " file %255s %u", path, &blocks) == 2) {
+            int i = add(path, false);
+            files[i].size = (FSIZE_t)blocks * ADT_BLOCK;
+            files[i].data = malloc(files[i].size);
+            for (FSIZE_t offset = 0; offset < files[i].size; offset++) {
+                files[i].data[offset] = pattern(offset);
+            }
+        } else if (sscanf(text, " dir %255s", path) == 1) {
+            add(path, true);
+        } else if (sscanf(text, " wait %u", &ms) == 1) {
+            now += ms * 1000ull;
+            run();
+        } else if (!strncmp(&text[strspn(text, " \t")], "full", 4)) {
+            full = true;
+        } else if (sscanf(text, " check %255s %u", path, &blocks) == 2) {
+            int i = find(path);
+            bool same = i >= 0 && files[i].size == (FSIZE_t)blocks * ADT_BLOCK;
+            for (FSIZE_t offset = 0; same && offset < files[i].size; offset++) {
+                same = files[i].data[offset] == pattern(offset);
+            }
+            if (!same) {
+                printf("line %d: %s doesn't hold the test data\n", line, path);
+                failed++;
+            }
+        } else if (text[strspn(text, " \t")] == '>') {
+            int count = parse(strchr(text, '>') + 1, bytes, line);
+            memcpy(&input[input_head], bytes, count);
+            input_head += count;
+            run();
+        } else if (text[strspn(text, " \t")] == '<') {
+            int count = parse(strchr(text, '<') + 1, bytes, line);
+            for (int i = 0; i < count; i++) {
+                if (output_tail == output_head) {
+                    printf("line %d: byte %d missing, expected %02X\n", line, i, bytes[i]);
+                    failed++;
+                    break;
+                }
+                if (output[output_tail] != bytes[i]) {
+                    printf("line %d: byte %d is %02X, expected %02X\n", line, i, output[output_tail], bytes[i]);
+                    failed++;
+                    output_tail = output_head;
+                    break;
+                }
+                output_tail++;
+            }
+        } else if (text[strspn(text, " \t\r\n")]) {
+            fprintf(stderr, "line %d: unknown line\n", line);
+            return 1;
+        }
+    }
+    fclose(session);
+
+    if (output_tail != output_head) {
+        printf("%d bytes from the card left over\n", output_head - output_tail);
+        failed++;
+    }
+    if (input_tail != input_head) {
+        printf("%d bytes from the client left over\n", input_head - input_tail);
+        failed++;
+    }
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}
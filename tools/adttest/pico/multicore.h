@@ -0,0 +1,14 @@
+//  Host stand-in for the Pico SDK, the FIFOs are the session's byte streams
+
+#ifndef _PICO_MULTICORE_H
+#define _PICO_MULTICORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool multicore_fifo_wready(void);
+void multicore_fifo_push_blocking(uint32_t data);
+bool multicore_fifo_rvalid(void);
+uint32_t multicore_fifo_pop_blocking(void);
+
+#endif //   _PICO_MULTICORE_H
@@ -0,0 +1,156 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/*
+
+Linux host end of the A2retroNET SmartPort character unit (USB CDC).
+
+    cc -o cdctest cdctest.c
+    cdctest /dev/ttyACM0 echo           send back everything the Apple II writes
+    cdctest /dev/ttyACM0 sink           count what the Apple II writes
+    cdctest /dev/ttyACM0 source         keep the Apple II supplied with data
+
+Every mode prints the bytes per second in each direction once a second.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <time.h>
+
+#define CHUNK   4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_raw(const char *device) {
+    int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        perror("tcgetattr");
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio) < 0) {
+        perror("tcsetattr");
+        close(fd);
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3 ||
+        (strcmp(argv[2], "echo") && strcmp(argv[2], "sink") && strcmp(argv[2], "source"))) {
+        fprintf(stderr, "usage: %s device echo|sink|source\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open_raw(argv[1]);
+    if (fd < 0) {
+        return 1;
+    }
+
+    int echo = !strcmp(argv[2], "echo");
+    int source = !strcmp(argv[2], "source");
+
+    static unsigned char buffer[CHUNK];
+    unsigned char pattern = 0;
+    size_t pending = 0;         //  Received but not yet echoed
+    long long in = 0, out = 0;
+    double report = now() + 1.0;
+
+    while (1) {
+        struct pollfd pfd = { fd, POLLIN | (pending || source ? POLLOUT : 0), 0 };
+        if (poll(&pfd, 1, 100) < 0) {
+            perror("poll");
+            return 1;
+        }
+
+        if (pfd.revents & POLLIN && !pending) {
+            ssize_t count = read(fd, buffer, sizeof(buffer));
+            if (count < 0) {
+                perror("read");
+                return 1;
+            }
+            in += count;
+            if (echo) {
+                pending = count;
+            }
+        }
+
+        if (pfd.revents & POLLOUT) {
+            if (source) {
+                for (size_t i = 0; i < sizeof(buffer); i++) {
+                    buffer[i] = pattern++;
+                }
+                pending = sizeof(buffer);
+            }
+            ssize_t count = write(fd, buffer, pending);
+            if (count < 0) {
+                perror("write");
+                return 1;
+            }
+            if (count < (ssize_t)pending) {
+                memmove(buffer, &buffer[count], pending - count);
+                if (source) {
+                    pattern -= pending - count;     //  Keep the pattern continuous
+                }
+            }
+            pending -= count;
+            out += count;
+            if (source) {
+                pending = 0;
+            }
+        }
+
+        double t = now();
+        if (t >= report) {
+            printf("in %lld B/s, out %lld B/s\n", in, out);
+            fflush(stdout);
+            in = out = 0;
+            report = t + 1.0;
+        }
+    }
+}
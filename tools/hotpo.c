@@ -0,0 +1,433 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/*
+
+Host tool that rewrites a ProDOS image so the blocks the card saw accessed
+most sit together, using the <image>.hot dump written by Ctrl-D in the
+Configuration Utility or SmartPort Control code $43.
+
+    cc -o hotpo hotpo.c
+    hotpo image.po image.po.hot out.po
+
+The volume directory and bitmap stay right after the boot blocks, then come
+the subdirectories and files, most accesses per block first. Every file is
+kept contiguous, index blocks ahead of its data, and all pointers and the
+bitmap are redone.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hot.h"
+
+#define BLOCK_SIZE      512
+#define BITS_PER_BLOCK  (BLOCK_SIZE * 8)
+
+enum { KIND_FREE, KIND_BOOT, KIND_DIR, KIND_BITMAP, KIND_INDEX, KIND_EXTENDED, KIND_DATA };
+
+enum { UNIT_VOLUME, UNIT_BITMAP, UNIT_DIR, UNIT_FILE };
+
+typedef struct {
+    int      type;
+    uint32_t start;             //  First entry in order[]
+    uint32_t count;
+    uint32_t heat;
+} unit_t;
+
+static uint8_t  *image;
+static uint8_t  *heat;
+static uint8_t  *kind;
+static uint16_t *dir_key;       //  Key block of the directory a block is chained into
+static uint16_t  blocks;
+
+static uint16_t *order;         //  Blocks in placement order, grouped by unit
+static uint32_t  ordered;
+static unit_t   *units;
+static uint32_t  unit_count;
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static uint8_t *block_at(uint16_t block) {
+    return &image[block * BLOCK_SIZE];
+}
+
+static unit_t *new_unit(int type) {
+    unit_t *unit = &units[unit_count++];
+    unit->type = type;
+    unit->start = ordered;
+    unit->count = 0;
+    unit->heat = 0;
+    return unit;
+}
+
+//  Every block belongs to exactly one unit, anything else is a damaged volume
+static int claim(unit_t *unit, uint16_t block, int block_kind) {
+    if (block == 0 || block >= blocks || kind[block] != KIND_FREE) {
+        fprintf(stderr, "bad or shared block %u\n", block);
+        return 0;
+    }
+    kind[block] = block_kind;
+    order[ordered++] = block;
+    unit->count++;
+    unit->heat += heat[block];
+    return 1;
+}
+
+//  Sparse (zero) pointers stay unallocated
+static int claim_data(unit_t *unit, uint16_t block) {
+    return block == 0 || claim(unit, block, KIND_DATA);
+}
+
+static int claim_index(unit_t *unit, uint16_t index) {
+    if (!claim(unit, index, KIND_INDEX)) {
+        return 0;
+    }
+    const uint8_t *data = block_at(index);
+    for (int i = 0; i < 256; i++) {
+        if (!claim_data(unit, data[i] | data[256 + i] << 8)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int claim_fork(unit_t *unit, int storage_type, uint16_t key) {
+    switch (storage_type) {
+        case 1:     // Seedling
+            return claim(unit, key, KIND_DATA);
+        case 2:     // Sapling
+            return claim_index(unit, key);
+        case 3: {   // Tree, all index blocks first, then the data in order
+            if (!claim(unit, key, KIND_INDEX)) {
+                return 0;
+            }
+            const uint8_t *master = block_at(key);
+            for (int i = 0; i < 256; i++) {
+                uint16_t index = master[i] | master[256 + i] << 8;
+                if (index && !claim(unit, index, KIND_INDEX)) {
+                    return 0;
+                }
+            }
+            for (int i = 0; i < 256; i++) {
+                uint16_t index = master[i] | master[256 + i] << 8;
+                if (!index) {
+                    continue;
+                }
+                const uint8_t *data = block_at(index);
+                for (int j = 0; j < 256; j++) {
+                    if (!claim_data(unit, data[j] | data[256 + j] << 8)) {
+                        return 0;
+                    }
+                }
+            }
+            return 1;
+        }
+    }
+    fprintf(stderr, "unsupported storage type %d\n", storage_type);
+    return 0;
+}
+
+static int walk_dir(uint16_t key, int type);
+
+static int walk_entry(const uint8_t *entry) {
+    int storage_type = entry[0x00] >> 4;
+    uint16_t key = get16(&entry[0x11]);
+
+    switch (storage_type) {
+        case 0x0:   // Deleted
+            return 1;
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            return claim_fork(new_unit(UNIT_FILE), storage_type, key);
+        case 0x5: { // Extended, data fork then resource fork
+            unit_t *unit = new_unit(UNIT_FILE);
+            if (!claim(unit, key, KIND_EXTENDED)) {
+                return 0;
+            }
+            const uint8_t *data = block_at(key);
+            return claim_fork(unit, data[0x000] & 0x0F, get16(&data[0x001])) &&
+                   claim_fork(unit, data[0x100] & 0x0F, get16(&data[0x101]));
+        }
+        case 0xD:
+            return walk_dir(key, UNIT_DIR);
+    }
+    fprintf(stderr, "unsupported storage type %d\n", storage_type);
+    return 0;
+}
+
+static int walk_dir(uint16_t key, int type) {
+    unit_t *unit = new_unit(type);
+    uint32_t first = ordered;
+
+    //  The whole chain first, so the unit stays in one piece in order[]
+    for (uint16_t block = key; block; block = get16(&block_at(block)[2])) {
+        if (!claim(unit, block, KIND_DIR)) {
+            return 0;
+        }
+        dir_key[block] = key;
+    }
+
+    const uint8_t *header = &block_at(key)[4];
+    int entry_length = header[0x1F];
+    int entries_per_block = header[0x20];
+    if (entry_length < 0x27 || entries_per_block * entry_length > BLOCK_SIZE - 4) {
+        fprintf(stderr, "bad directory in block %u\n", key);
+        return 0;
+    }
+
+    uint32_t last = ordered;
+    for (uint32_t i = first; i < last; i++) {
+        const uint8_t *data = block_at(order[i]);
+        for (int slot = i == first ? 1 : 0; slot < entries_per_block; slot++) {
+            if (!walk_entry(&data[4 + slot * entry_length])) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static int compare_units(const void *a, const void *b) {
+    const unit_t *x = a;
+    const unit_t *y = b;
+    if (x->type != y->type) {
+        return x->type - y->type;
+    }
+    //  By mean heat, a big file with a few hot blocks mustn't push small hot files back
+    uint64_t x_heat = (uint64_t)x->heat * y->count;
+    uint64_t y_heat = (uint64_t)y->heat * x->count;
+    if (x_heat != y_heat) {
+        return x_heat < y_heat ? 1 : -1;
+    }
+    return order[x->start] - order[y->start];
+}
+
+static uint16_t remap(const uint16_t *moved, uint16_t block) {
+    return block ? moved[block] : 0;
+}
+
+static void remap16(const uint16_t *moved, uint8_t *p) {
+    put16(p, remap(moved, get16(p)));
+}
+
+static void remap_index(const uint16_t *moved, uint8_t *data) {
+    for (int i = 0; i < 256; i++) {
+        uint16_t block = remap(moved, data[i] | data[256 + i] << 8);
+        data[i] = block & 0xFF;
+        data[256 + i] = block >> 8;
+    }
+}
+
+static void remap_dir(const uint16_t *moved, uint8_t *data, uint16_t block) {
+    remap16(moved, &data[0]);
+    remap16(moved, &data[2]);
+
+    const uint8_t *header = &block_at(dir_key[block])[4];
+    int entry_length = header[0x1F];
+    int entries_per_block = header[0x20];
+
+    for (int slot = 0; slot < entries_per_block; slot++) {
+        uint8_t *entry = &data[4 + slot * entry_length];
+        int storage_type = entry[0x00] >> 4;
+        if (slot == 0 && dir_key[block] == block) {
+            //  Volume bit_map_pointer, subdirectory parent_pointer
+            remap16(moved, &entry[0x23]);
+        } else if (storage_type) {
+            remap16(moved, &entry[0x11]);
+            remap16(moved, &entry[0x25]);
+        }
+    }
+}
+
+static int rewrite(FILE *out, uint16_t total_blocks) {
+    uint16_t *moved = calloc(blocks, sizeof(uint16_t));
+    uint8_t *output = calloc(blocks, BLOCK_SIZE);
+
+    moved[0] = 0;
+    moved[1] = 1;
+    uint16_t next = 2;
+    for (uint32_t u = 0; u < unit_count; u++) {
+        for (uint32_t i = 0; i < units[u].count; i++) {
+            moved[order[units[u].start + i]] = next++;
+        }
+    }
+
+    for (uint32_t block = 0; block < blocks; block++) {
+        if (kind[block] == KIND_FREE) {
+            continue;
+        }
+        uint8_t *data = &output[moved[block] * BLOCK_SIZE];
+        memcpy(data, block_at(block), BLOCK_SIZE);
+
+        switch (kind[block]) {
+            case KIND_DIR:
+                remap_dir(moved, data, block);
+                break;
+            case KIND_INDEX:
+                remap_index(moved, data);
+                break;
+            case KIND_EXTENDED:
+                remap16(moved, &data[0x001]);
+                remap16(moved, &data[0x101]);
+                break;
+        }
+    }
+
+    //  Everything from next on is free
+    uint16_t bitmap = moved[get16(&block_at(2)[0x27])];
+    uint8_t *bits = &output[bitmap * BLOCK_SIZE];
+    memset(bits, 0x00, (total_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK * BLOCK_SIZE);
+    for (uint32_t block = next; block < total_blocks; block++) {
+        bits[block / 8] |= 0x80 >> (block % 8);
+    }
+
+    int result = 0;
+    if (fwrite(output, BLOCK_SIZE, blocks, out) != blocks) {
+        fprintf(stderr, "write error\n");
+        result = 1;
+    }
+
+    if (!result) {
+        uint32_t files = 0;
+        uint32_t dirs = 0;
+        for (uint32_t u = 0; u < unit_count; u++) {
+            files += units[u].type == UNIT_FILE;
+            dirs += units[u].type == UNIT_DIR;
+        }
+        printf("%u blocks, %u used, %u files, %u directories\n", blocks, next, files, dirs);
+    }
+
+    free(output);
+    free(moved);
+    return result;
+}
+
+static int optimize(FILE *in, FILE *hot, FILE *out) {
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    if (size % BLOCK_SIZE || size / BLOCK_SIZE > 0xFFFF || size / BLOCK_SIZE < 8) {
+        fprintf(stderr, "not a ProDOS block image of up to 32MB\n");
+        return 1;
+    }
+    blocks = size / BLOCK_SIZE;
+
+    uint8_t header[HOT_HEADER_SIZE];
+    if (fread(header, HOT_HEADER_SIZE, 1, hot) != 1 ||
+        memcmp(header, HOT_MAGIC, 4) || get16(&header[4]) != HOT_VERSION) {
+        fprintf(stderr, "not a hot block dump\n");
+        return 1;
+    }
+    if (get16(&header[6]) != blocks) {
+        fprintf(stderr, "hot block dump is for %u blocks, image has %u\n", get16(&header[6]), blocks);
+        return 1;
+    }
+
+    image = malloc(blocks * BLOCK_SIZE);
+    heat = malloc(blocks);
+    kind = calloc(blocks, 1);
+    dir_key = calloc(blocks, sizeof(uint16_t));
+    order = malloc(blocks * sizeof(uint16_t));
+    units = malloc(blocks * sizeof(unit_t));
+    if (fread(image, BLOCK_SIZE, blocks, in) != blocks || fread(heat, blocks, 1, hot) != 1) {
+        fprintf(stderr, "read error\n");
+        return 1;
+    }
+
+    const uint8_t *volume = &block_at(2)[4];
+    uint16_t total_blocks = get16(&volume[0x25]);
+    if (volume[0x00] >> 4 != 0xF || total_blocks > blocks) {
+        fprintf(stderr, "not a ProDOS volume\n");
+        return 1;
+    }
+
+    kind[0] = KIND_BOOT;
+    kind[1] = KIND_BOOT;
+    if (!walk_dir(2, UNIT_VOLUME)) {
+        return 1;
+    }
+
+    unit_t *unit = new_unit(UNIT_BITMAP);
+    uint16_t bitmap = get16(&volume[0x23]);
+    for (int i = 0; i < (total_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK; i++) {
+        if (!claim(unit, bitmap + i, KIND_BITMAP)) {
+            return 1;
+        }
+    }
+
+    //  The volume directory and bitmap stay first, they sort ahead of the rest
+    qsort(units, unit_count, sizeof(unit_t), compare_units);
+
+    return rewrite(out, total_blocks);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <in.po|in.hdv> <in.hot> <out.po>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE *hot = fopen(argv[2], "rb");
+    if (!hot) {
+        perror(argv[2]);
+        fclose(in);
+        return 1;
+    }
+    FILE *out = fopen(argv[3], "wb");
+    if (!out) {
+        perror(argv[3]);
+        fclose(hot);
+        fclose(in);
+        return 1;
+    }
+
+    int result = optimize(in, hot, out);
+
+    fclose(hot);
+    fclose(in);
+    if (fclose(out) != 0) {
+        perror(argv[3]);
+        result = 1;
+    }
+    return result;
+}
@@ -0,0 +1,200 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+/*
+
+Host converter between flat ProDOS images and A2retroNET thin images.
+
+    cc -o tpo tpo.c
+    tpo image.po image.tpo      flat to thin, all-zero blocks stay unallocated
+    tpo image.tpo image.po      thin to flat
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../thin.h"
+
+#define BLOCK_SIZE  512
+
+static int is_zero(const uint8_t *data) {
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (data[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v & 0xFFFF);
+    put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static int to_thin(FILE *in, FILE *out) {
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    if (size % BLOCK_SIZE) {
+        fprintf(stderr, "not a ProDOS block image\n");
+        return 1;
+    }
+    //  Like the card, which shows ProDOS at most 0xFFFF blocks of a flat image
+    uint16_t blocks = size / BLOCK_SIZE > THIN_MAX_BLOCKS ? THIN_MAX_BLOCKS : size / BLOCK_SIZE;
+    if (size / BLOCK_SIZE > blocks) {
+        printf("%ld blocks past %u dropped\n", size / BLOCK_SIZE - blocks, blocks);
+    }
+    uint32_t data_offset = THIN_HEADER_SIZE + THIN_MAP_SIZE(blocks);
+
+    uint8_t *map = calloc(1, THIN_MAP_SIZE(blocks));
+    uint8_t header[THIN_HEADER_SIZE] = {0};
+    memcpy(header, THIN_MAGIC, 4);
+    put16(&header[4], THIN_VERSION);
+    put16(&header[6], blocks);
+    put32(&header[8], data_offset);
+
+    //  Data first, header and map once the slots are known
+    fseek(out, data_offset, SEEK_SET);
+
+    uint16_t slots = 0;
+    uint8_t data[BLOCK_SIZE];
+    for (uint16_t block = 0; block < blocks; block++) {
+        if (fread(data, BLOCK_SIZE, 1, in) != 1) {
+            fprintf(stderr, "read error\n");
+            free(map);
+            return 1;
+        }
+        if (is_zero(data)) {
+            continue;
+        }
+        put16(&map[block * 2], ++slots);
+        if (fwrite(data, BLOCK_SIZE, 1, out) != 1) {
+            fprintf(stderr, "write error\n");
+            free(map);
+            return 1;
+        }
+    }
+
+    fseek(out, 0, SEEK_SET);
+    if (fwrite(header, THIN_HEADER_SIZE, 1, out) != 1 ||
+        fwrite(map, THIN_MAP_SIZE(blocks), 1, out) != 1) {
+        fprintf(stderr, "write error\n");
+        free(map);
+        return 1;
+    }
+    free(map);
+
+    printf("%u blocks, %u allocated\n", blocks, slots);
+    return 0;
+}
+
+static int to_flat(FILE *in, FILE *out) {
+    uint8_t header[THIN_HEADER_SIZE];
+    if (fread(header, THIN_HEADER_SIZE, 1, in) != 1 ||
+        memcmp(header, THIN_MAGIC, 4) || get16(&header[4]) != THIN_VERSION) {
+        fprintf(stderr, "not a thin image\n");
+        return 1;
+    }
+    uint16_t blocks = get16(&header[6]);
+    uint32_t data_offset = get32(&header[8]);
+
+    uint8_t *map = malloc(THIN_MAP_SIZE(blocks));
+    if (fread(map, THIN_MAP_SIZE(blocks), 1, in) != 1) {
+        fprintf(stderr, "read error\n");
+        free(map);
+        return 1;
+    }
+
+    uint8_t data[BLOCK_SIZE];
+    for (uint16_t block = 0; block < blocks; block++) {
+        uint16_t slot = get16(&map[block * 2]);
+        if (slot) {
+            fseek(in, data_offset + (slot - 1) * (long)BLOCK_SIZE, SEEK_SET);
+            if (fread(data, BLOCK_SIZE, 1, in) != 1) {
+                fprintf(stderr, "read error\n");
+                free(map);
+                return 1;
+            }
+        } else {
+            memset(data, 0x00, BLOCK_SIZE);
+        }
+        if (fwrite(data, BLOCK_SIZE, 1, out) != 1) {
+            fprintf(stderr, "write error\n");
+            free(map);
+            return 1;
+        }
+    }
+    free(map);
+
+    printf("%u blocks\n", blocks);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.po|in.hdv|in.tpo> <out.tpo|out.po>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    char *extension = strrchr(argv[1], '.');
+    int result = extension && strcasecmp(extension, ".tpo") == 0 ? to_flat(in, out) : to_thin(in, out);
+
+    fclose(in);
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        result = 1;
+    }
+    return result;
+}
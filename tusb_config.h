@@ -46,7 +46,7 @@
 #define CFG_TUD_MSC_EP_BUFSIZE  8192
 
 #define CFG_TUD_CDC_EP_BUFSIZE  64
-#define CFG_TUD_CDC_RX_BUFSIZE  64
-#define CFG_TUD_CDC_TX_BUFSIZE  64
+#define CFG_TUD_CDC_RX_BUFSIZE  512     //  Bulk SmartPort character unit transfers
+#define CFG_TUD_CDC_TX_BUFSIZE  512
 
 #endif
@@ -0,0 +1,404 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+//  A dir:/path drive shows the files of a FAT directory as a ProDOS volume,
+//  so nothing has to be put into a disk image first. The layout is fixed when
+//  the drive is opened:
+//
+//    0 - 1               Boot blocks, zeros
+//    2 - 5               Volume directory, built once and kept in RAM
+//    6 -                 Bitmap, zeros as every block is in use
+//    then per file       Key block, index blocks of a tree, data blocks
+//
+//  Index blocks are computed from the layout when they are read and data
+//  blocks are read from the file, one FIL is kept open with a fast seek table.
+//  Only the top level is shown, names are made ProDOS compatible and a
+//  CiderPress style #tthhhh suffix sets the file type and aux type.
+
+#include "vdir.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <f_util.h>
+
+#include "config.h"
+
+#define BLOCK_SIZE      512
+
+#define VDIR_KEY        2           //  Volume directory key block
+#define VDIR_DIR_BLOCKS 4
+#define VDIR_BITMAP     (VDIR_KEY + VDIR_DIR_BLOCKS)
+#define VDIR_FILES      (VDIR_DIR_BLOCKS * VDIR_PER_BLOCK - 1)
+#define VDIR_PER_BLOCK  13
+#define VDIR_ENTRY_SIZE 0x27
+#define VDIR_MAX_BLOCKS 0xFFFF
+#define VDIR_MAX_EOF    0xFFFFFF    //  16 MB, the largest tree file
+#define VDIR_LINKMAP    32          //  Fast seek table DWORDs, 15 fragments
+#define VDIR_NAMES      2048        //  FAT names of all files, exFAT ones are long
+
+#define SEEDLING    1
+#define SAPLING     2
+#define TREE        3
+
+typedef struct {
+    uint16_t name;                  //  FAT name in names[], the 8.3 one if there is one
+    uint8_t  storage;
+    uint16_t used;                  //  Blocks including key and index blocks
+    uint16_t key;
+    uint16_t data;                  //  First data block
+    uint16_t count;                 //  Data blocks
+} vdir_file;
+
+static struct {
+    bool     open;
+    char     dir[MAX_PATH];
+    uint16_t blocks;
+    uint8_t  bitmap;                //  Bitmap blocks
+    int      count;
+    vdir_file file[VDIR_FILES];
+    char     names[VDIR_NAMES];
+    uint16_t names_used;
+    int      current;               //  File in fil, -1 if none
+    FIL      fil;
+    DWORD    linkmap[VDIR_LINKMAP];
+    uint8_t  directory[VDIR_DIR_BLOCKS][BLOCK_SIZE];
+} vdir;
+
+static void put_word(uint8_t *p, uint16_t value) {
+    p[0] = value % 0x100;
+    p[1] = value / 0x100;
+}
+
+//  FAT years count from 1980, ProDOS ones are two digits
+static void put_date(uint8_t *p, WORD fdate, WORD ftime) {
+    put_word(p, (((fdate >> 9) + 80) % 100) << 9 | (fdate & 0x01FF));
+    p[2] = ftime >> 5 & 0x3F;
+    p[3] = ftime >> 11;
+}
+
+static const char *file_name(int file) {
+    return &vdir.names[vdir.file[file].name];
+}
+
+static uint8_t *entry_at(int file) {
+    int slot = file + 1;            //  The volume header comes first
+    return &vdir.directory[slot / VDIR_PER_BLOCK][4 + slot % VDIR_PER_BLOCK * VDIR_ENTRY_SIZE];
+}
+
+static const struct {
+    const char *extension;
+    uint8_t     type;
+    uint16_t    aux;
+} types[] = {
+    { ".SYSTEM", 0xFF, 0x2000 },
+    { ".SYS",    0xFF, 0x2000 },
+    { ".BAS",    0xFC, 0x0801 },
+    { ".TXT",    0x04, 0x0000 },
+};
+
+//  Returns the name length, the type comes from a #tthhhh suffix or the extension
+static int prodos_name(const char *fname, char *name, uint8_t *type, uint16_t *aux) {
+    char buffer[FF_LFN_BUF + 1];
+    snprintf(buffer, sizeof(buffer), "%s", fname);
+
+    *type = 0x06;
+    *aux = 0x0000;
+
+    char *hash = strrchr(buffer, '#');
+    if (hash && strlen(hash) == 7 && strspn(hash + 1, "0123456789ABCDEFabcdef") == 6) {
+        unsigned long value = strtoul(hash + 1, NULL, 16);
+        *type = value >> 16;
+        *aux = value & 0xFFFF;
+        *hash = '\0';
+    } else {
+        char *extension = strrchr(buffer, '.');
+        for (int i = 0; extension && i < sizeof(types) / sizeof(types[0]); i++) {
+            if (!strcasecmp(extension, types[i].extension)) {
+                *type = types[i].type;
+                *aux = types[i].aux;
+            }
+        }
+    }
+
+    //  A letter first, then letters, digits and periods
+    int length = 0;
+    if (!isalpha((unsigned char)buffer[0])) {
+        name[length++] = 'X';
+    }
+    for (const char *c = buffer; *c && length < 15; c++) {
+        name[length++] = isalnum((unsigned char)*c) ? toupper((unsigned char)*c) : '.';
+    }
+    return length;
+}
+
+static bool is_duplicate(int file, const char *name, int length) {
+    for (int i = 0; i < file; i++) {
+        uint8_t *entry = entry_at(i);
+        if ((entry[0x00] & 0x0F) == length && !memcmp(&entry[0x01], name, length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//  Returns false if the file doesn't fit into a ProDOS volume
+static bool add_file(const FILINFO *fno, uint32_t *used) {
+    const char *fat_name = fno->altname[0] ? fno->altname : fno->fname;
+    size_t name_size = strlen(fat_name) + 1;
+    if (vdir.names_used + name_size > VDIR_NAMES || fno->fsize > VDIR_MAX_EOF) {
+        return false;
+    }
+
+    uint16_t count = fno->fsize ? (fno->fsize + BLOCK_SIZE - 1) / BLOCK_SIZE : 1;
+    uint8_t storage = count == 1 ? SEEDLING : count <= 256 ? SAPLING : TREE;
+    uint16_t index = storage == TREE ? (count + 255) / 256 : 0;
+    uint16_t blocks = (storage == SEEDLING ? 0 : 1) + index + count;
+
+    //  Leave room for the largest bitmap
+    if (*used + blocks > VDIR_MAX_BLOCKS - VDIR_BITMAP - 16) {
+        return false;
+    }
+    *used += blocks;
+
+    char name[15];
+    uint8_t type;
+    uint16_t aux;
+    int length = prodos_name(fno->fname, name, &type, &aux);
+    for (int i = 1; i <= 9 && is_duplicate(vdir.count, name, length); i++) {
+        name[length - 1] = '0' + i;
+    }
+
+    uint8_t *entry = entry_at(vdir.count);
+    entry[0x00] = storage << 4 | length;
+    memcpy(&entry[0x01], name, length);
+    entry[0x10] = type;
+    put_word(&entry[0x13], blocks);
+    put_word(&entry[0x15], fno->fsize & 0xFFFF);
+    entry[0x17] = fno->fsize >> 16;
+    put_date(&entry[0x18], fno->fdate, fno->ftime);
+    entry[0x1E] = 0x01;             //  Read only
+    put_word(&entry[0x1F], aux);
+    put_date(&entry[0x21], fno->fdate, fno->ftime);
+    put_word(&entry[0x25], VDIR_KEY);
+
+    memcpy(&vdir.names[vdir.names_used], fat_name, name_size);
+    vdir.file[vdir.count].name = vdir.names_used;
+    vdir.names_used += name_size;
+    vdir.file[vdir.count].storage = storage;
+    vdir.file[vdir.count].used = blocks;
+    vdir.file[vdir.count].count = count;
+    vdir.count++;
+    return true;
+}
+
+//  Files follow the bitmap, which has to cover the whole volume
+static void layout(uint32_t used) {
+    vdir.bitmap = 1;
+    while (VDIR_BITMAP + vdir.bitmap + used > vdir.bitmap * 4096) {
+        vdir.bitmap++;
+    }
+    vdir.blocks = VDIR_BITMAP + vdir.bitmap + used;
+
+    uint16_t next = VDIR_BITMAP + vdir.bitmap;
+    for (int i = 0; i < vdir.count; i++) {
+        vdir.file[i].key = next;
+        vdir.file[i].data = next + vdir.file[i].used - vdir.file[i].count;
+        put_word(&entry_at(i)[0x11], next);
+        next += vdir.file[i].used;
+    }
+}
+
+static void put_header(void) {
+    for (int block = 0; block < VDIR_DIR_BLOCKS; block++) {
+        put_word(&vdir.directory[block][0x00], block ? VDIR_KEY + block - 1 : 0);
+        put_word(&vdir.directory[block][0x02], block < VDIR_DIR_BLOCKS - 1 ? VDIR_KEY + block + 1 : 0);
+    }
+
+    //  The volume is named after the directory
+    const char *slash = strrchr(vdir.dir, '/');
+    const char *colon = strrchr(vdir.dir, ':');
+    const char *last = slash ? slash + 1 : colon ? colon + 1 : vdir.dir;
+
+    char name[15];
+    uint8_t type;
+    uint16_t aux;
+    int length = prodos_name(*last ? last : "A2RETRONET", name, &type, &aux);
+
+    uint8_t *header = &vdir.directory[0][0x04];
+    header[0x00] = 0xF0 | length;
+    memcpy(&header[0x01], name, length);
+    header[0x1E] = 0xC3;
+    header[0x1F] = VDIR_ENTRY_SIZE;
+    header[0x20] = VDIR_PER_BLOCK;
+    put_word(&header[0x21], vdir.count);
+    put_word(&header[0x23], VDIR_BITMAP);
+    put_word(&header[0x25], vdir.blocks);
+}
+
+uint16_t vdir_open(const char *dir) {
+    if (vdir.open) {
+        printf("  Virtual Volume In Use\n");
+        return 0;
+    }
+
+    memset(&vdir, 0, sizeof(vdir));
+    vdir.current = -1;
+    snprintf(vdir.dir, MAX_PATH, "%s", dir);
+    if (vdir.dir[0] && vdir.dir[strlen(vdir.dir) - 1] == '/') {
+        vdir.dir[strlen(vdir.dir) - 1] = '\0';
+    }
+
+    char path[MAX_PATH];
+    snprintf(path, MAX_PATH, "%s/", vdir.dir);
+
+    DIR listing;
+    FRESULT fr = f_opendir(&listing, path);
+    if (fr != FR_OK) {
+        printf("f_opendir(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+        return 0;
+    }
+
+    uint32_t used = 0;
+    FILINFO fno;
+    while (vdir.count < VDIR_FILES && f_readdir(&listing, &fno) == FR_OK && fno.fname[0]) {
+        if ((fno.fattrib & (AM_DIR | AM_HID | AM_SYS)) || fno.fname[0] == '.') {
+            continue;
+        }
+        if (!add_file(&fno, &used)) {
+            printf("  Skipped %s\n", fno.fname);
+        }
+    }
+    f_closedir(&listing);
+
+    layout(used);
+    put_header();
+
+    vdir.open = true;
+    printf("  Virtual Volume of %d Files\n", vdir.count);
+    printf("  %u Blocks\n", vdir.blocks);
+    return vdir.blocks;
+}
+
+static void close_file(void) {
+    if (vdir.current >= 0) {
+        FRESULT fr = f_close(&vdir.fil);
+        if (fr != FR_OK) {
+            printf("f_close(%s) error: %s (%d)\n", file_name(vdir.current), FRESULT_str(fr), fr);
+        }
+    }
+    vdir.current = -1;
+}
+
+void vdir_close(void) {
+    close_file();
+    vdir.open = false;
+}
+
+//  Low bytes in the first half, high bytes in the second
+static void put_index(uint8_t *data, uint16_t first, int count) {
+    for (int i = 0; i < count; i++) {
+        data[i] = (first + i) % 0x100;
+        data[0x100 + i] = (first + i) / 0x100;
+    }
+}
+
+static bool read_data(int file, uint16_t block, uint8_t *data) {
+    if (vdir.current != file) {
+        close_file();
+
+        char path[MAX_PATH];
+        snprintf(path, MAX_PATH, "%s/%s", vdir.dir, file_name(file));
+        FRESULT fr = f_open(&vdir.fil, path, FA_OPEN_EXISTING | FA_READ);
+        if (fr != FR_OK) {
+            printf("f_open(%s) error: %s (%d)\n", path, FRESULT_str(fr), fr);
+            return false;
+        }
+        vdir.current = file;
+
+        vdir.linkmap[0] = VDIR_LINKMAP;
+        vdir.fil.cltbl = vdir.linkmap;
+        if (f_lseek(&vdir.fil, CREATE_LINKMAP) != FR_OK) {
+            vdir.fil.cltbl = NULL;
+        }
+    }
+
+    FRESULT fr = f_lseek(&vdir.fil, (FSIZE_t)block * BLOCK_SIZE);
+    if (fr != FR_OK) {
+        printf("f_lseek(%s) error: %s (%d)\n", file_name(file), FRESULT_str(fr), fr);
+        return false;
+    }
+
+    //  The last block is short, the rest stays zero
+    UINT br;
+    fr = f_read(&vdir.fil, data, BLOCK_SIZE, &br);
+    if (fr != FR_OK) {
+        printf("f_read(%s) error: %s (%d)\n", file_name(file), FRESULT_str(fr), fr);
+        return false;
+    }
+    return true;
+}
+
+bool vdir_read(uint16_t block, uint8_t *data) {
+    memset(data, 0x00, BLOCK_SIZE);
+
+    if (!vdir.open || block >= vdir.blocks) {
+        return false;
+    }
+    if (block >= VDIR_KEY && block < VDIR_BITMAP) {
+        memcpy(data, vdir.directory[block - VDIR_KEY], BLOCK_SIZE);
+        return true;
+    }
+    if (block < VDIR_BITMAP + vdir.bitmap) {
+        return true;
+    }
+
+    //  The last file starting at or before the block
+    int lo = 0, hi = vdir.count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (vdir.file[mid].key <= block) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    vdir_file *file = &vdir.file[lo];
+    if (block >= file->data) {
+        return read_data(lo, block - file->data, data);
+    }
+    if (file->storage == SAPLING) {
+        put_index(data, file->data, file->count);
+    } else if (block == file->key) {
+        put_index(data, file->key + 1, file->used - file->count - 1);
+    } else {
+        uint16_t first = (block - file->key - 1) * 256;
+        put_index(data, file->data + first, file->count - first < 256 ? file->count - first : 256);
+    }
+    return true;
+}
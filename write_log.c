@@ -0,0 +1,470 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+//  Scattered single sector writes are the slowest thing an SD card does, every
+//  CMD24 can cost a read-modify-program of a whole flash page. A sync of the
+//  block cache therefore appends the dirty sectors to a log instead, sequential
+//  writes into one allocation unit that the card handles well. In idle time the
+//  logged sectors are sorted and written home in batches, adjacent ones with a
+//  multi-sector write. Until then reads of a home sector are patched from the
+//  log, so the rest of the firmware never sees the difference.
+//
+//  The log is a hidden, contiguous file written by sector number:
+//
+//    0                   Superblock, the epoch
+//    1 -                 Segments, a header with the epoch, a sequence number,
+//                        the home sectors and a checksum, then the data
+//
+//  Once everything is home the epoch is bumped, which drops all segments at
+//  once. After a power loss the segments of the current epoch are replayed on
+//  the next mount. A direct write to a sector the log knows about first merges
+//  the whole log, so a replay never brings back an older copy.
+
+#include "write_log.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <glue.h>
+#include <pico/time.h>
+#include <f_util.h>
+
+#define BLOCK_SIZE          512
+#define WRITE_LOG_PATH      "SD:/A2retroNET.log"
+#define WRITE_LOG_SECTORS   1024    //  512 KB, superblock and segments
+#define WRITE_LOG_ALIGN     8192    //  4 MB, the usual SDHC allocation unit
+#define WRITE_LOG_MAGIC     "A2WL"
+#define NO_SECTOR           ((LBA_t)-1)
+#define REPLAY_TRIES        3
+
+typedef struct {
+    char     magic[4];
+    uint32_t epoch;
+    uint32_t seq;               //  Segment number in the epoch
+    uint32_t count;             //  Data sectors following the header
+    uint32_t sum;
+    LBA_t    sectors[WRITE_LOG_RUN];
+} log_header;
+
+static struct {
+    bool     enabled;
+    bool     blocked;           //  Segments left that couldn't be replayed, no writes until they are
+    BYTE     pdrv;
+    LBA_t    file_start;        //  The whole file, a write into it means it was deleted
+    LBA_t    file_end;
+    LBA_t    volume_start;      //  Home sectors of a replay must lie within
+    LBA_t    volume_end;
+    LBA_t    base;              //  Superblock, aligned
+    uint32_t epoch;
+    uint32_t seq;
+    UINT     head;              //  Next free log sector
+    UINT     staged;            //  Log sectors not home yet
+    LBA_t    home[WRITE_LOG_SECTORS];       //  Of each log sector, NO_SECTOR if none
+    uint8_t  pending[WRITE_LOG_SECTORS / 8];
+    uint32_t appends;
+    uint32_t sectors;
+    uint32_t merges;
+    uint32_t merged;
+    uint32_t patched;
+    uint32_t drains;
+    int      replayed;
+} wlog;
+
+static BYTE buffer[(WRITE_LOG_RUN + 1) * BLOCK_SIZE];
+
+static bool is_pending(UINT slot) {
+    return wlog.pending[slot / 8] & (1 << slot % 8);
+}
+
+static void set_pending(UINT slot, bool pending) {
+    if (pending) {
+        wlog.pending[slot / 8] |= 1 << slot % 8;
+    } else {
+        wlog.pending[slot / 8] &= ~(1 << slot % 8);
+    }
+}
+
+//  Rotating, so swapped words don't cancel out
+static uint32_t add_word(uint32_t sum, uint32_t word) {
+    return (sum << 1 | sum >> 31) + word;
+}
+
+//  The header as well, a stray one mustn't send good data to wrong sectors
+static uint32_t checksum(const log_header *header, const BYTE *data) {
+    uint32_t sum = 0;
+    for (UINT i = 0; i < header->count * BLOCK_SIZE; i += 4) {
+        uint32_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        sum = add_word(sum, word);
+    }
+    sum = add_word(sum, header->epoch);
+    sum = add_word(sum, header->seq);
+    sum = add_word(sum, header->count);
+    for (UINT k = 0; k < header->count; k++) {
+        sum = add_word(sum, (uint32_t)header->sectors[k]);
+        sum = add_word(sum, (uint32_t)((uint64_t)header->sectors[k] >> 32));
+    }
+    return sum;
+}
+
+//  Outside the volume or inside the log itself, the header is damaged
+static bool bad_home(LBA_t sector) {
+    return sector < wlog.volume_start || sector >= wlog.volume_end ||
+           (sector >= wlog.file_start && sector < wlog.file_end);
+}
+
+static DRESULT write_super(void) {
+    log_header header = { .epoch = wlog.epoch };
+    memcpy(header.magic, WRITE_LOG_MAGIC, sizeof(header.magic));
+
+    memset(buffer, 0x00, BLOCK_SIZE);
+    memcpy(buffer, &header, sizeof(header));
+    return sd_disk_write(wlog.pdrv, buffer, wlog.base, 1);
+}
+
+//  Everything is home, a new epoch drops all segments
+static DRESULT retire(void) {
+    wlog.epoch++;
+    DRESULT result = write_super();
+    if (result != RES_OK) {
+        //  Segments of the old epoch are still valid, a direct write would be undone by their replay
+        printf("Write Log Failed\n");
+        wlog.enabled = false;
+        wlog.blocked = wlog.head > 1;
+        return result;
+    }
+
+    for (UINT i = 0; i < WRITE_LOG_SECTORS; i++) {
+        wlog.home[i] = NO_SECTOR;
+    }
+    memset(wlog.pending, 0, sizeof(wlog.pending));
+    wlog.head = 1;
+    wlog.seq = 0;
+    wlog.staged = 0;
+    return RES_OK;
+}
+
+//  The lowest pending home sectors, adjacent ones go home with one multi-sector write
+static DRESULT merge_batch(void) {
+    UINT slots[WRITE_LOG_RUN];
+    UINT count = 0;
+
+    for (UINT i = 1; i < wlog.head; i++) {
+        if (!is_pending(i)) {
+            continue;
+        }
+        UINT k = count;
+        if (count < WRITE_LOG_RUN) {
+            count++;
+        } else if (wlog.home[i] < wlog.home[slots[count - 1]]) {
+            k = count - 1;
+        } else {
+            continue;
+        }
+        while (k > 0 && wlog.home[slots[k - 1]] > wlog.home[i]) {
+            slots[k] = slots[k - 1];
+            k--;
+        }
+        slots[k] = i;
+    }
+
+    for (UINT n = 0; n < count; n++) {
+        DRESULT result = sd_disk_read(wlog.pdrv, &buffer[n * BLOCK_SIZE], wlog.base + slots[n], 1);
+        if (result != RES_OK) {
+            return result;
+        }
+    }
+
+    for (UINT n = 0; n < count; ) {
+        UINT run = 1;
+        while (n + run < count && wlog.home[slots[n + run]] == wlog.home[slots[n]] + run) {
+            run++;
+        }
+        DRESULT result = sd_disk_write(wlog.pdrv, &buffer[n * BLOCK_SIZE], wlog.home[slots[n]], run);
+        if (result != RES_OK) {
+            return result;
+        }
+        for (UINT k = 0; k < run; k++) {
+            set_pending(slots[n + k], false);
+        }
+        wlog.staged -= run;
+        wlog.merged += run;
+        n += run;
+    }
+
+    wlog.merges++;
+    return RES_OK;
+}
+
+static DRESULT drain(void) {
+    wlog.drains++;
+    while (wlog.staged) {
+        DRESULT result = merge_batch();
+        if (result != RES_OK) {
+            return result;
+        }
+    }
+    return retire();
+}
+
+//  Segments follow each other until one is from an older epoch or torn, returns -1 on error
+static int replay(void) {
+    log_header header;
+    if (sd_disk_read(wlog.pdrv, buffer, wlog.base, 1) != RES_OK) {
+        return -1;
+    }
+    memcpy(&header, buffer, sizeof(header));
+    if (memcmp(header.magic, WRITE_LOG_MAGIC, sizeof(header.magic))) {
+        wlog.epoch = time_us_32();  //  Whatever is in there doesn't match by chance
+        return 0;
+    }
+    wlog.epoch = header.epoch;
+
+    int replayed = 0;
+    UINT head = 1;
+    for (uint32_t seq = 0; head < WRITE_LOG_SECTORS; seq++) {
+        if (sd_disk_read(wlog.pdrv, buffer, wlog.base + head, 1) != RES_OK) {
+            return -1;
+        }
+        memcpy(&header, buffer, sizeof(header));
+        if (memcmp(header.magic, WRITE_LOG_MAGIC, sizeof(header.magic)) || header.epoch != wlog.epoch ||
+            header.seq != seq || !header.count || header.count > WRITE_LOG_RUN ||
+            head + 1 + header.count > WRITE_LOG_SECTORS) {
+            break;
+        }
+        if (sd_disk_read(wlog.pdrv, &buffer[BLOCK_SIZE], wlog.base + head + 1, header.count) != RES_OK) {
+            return -1;
+        }
+        if (checksum(&header, &buffer[BLOCK_SIZE]) != header.sum) {
+            break;
+        }
+        UINT k = 0;
+        while (k < header.count && !bad_home(header.sectors[k])) {
+            k++;
+        }
+        if (k < header.count) {
+            printf("Write Log Bad Sector(%lu)\n", (unsigned long)header.sectors[k]);
+            break;
+        }
+        for (UINT k = 0; k < header.count; k++) {
+            if (sd_disk_write(wlog.pdrv, &buffer[(k + 1) * BLOCK_SIZE], header.sectors[k], 1) != RES_OK) {
+                return -1;
+            }
+        }
+        replayed += header.count;
+        head += 1 + header.count;
+    }
+
+    if (replayed) {
+        printf("Write Log Replay(Sectors=%d)\n", replayed);
+    }
+    return replayed;
+}
+
+int write_log_mount(FATFS *fs) {
+    memset(&wlog, 0, sizeof(wlog));
+
+    FIL fil;
+    FRESULT fr = f_open(&fil, WRITE_LOG_PATH, FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+    if (fr != FR_OK) {
+        printf("f_open(%s) error: %s (%d)\n", WRITE_LOG_PATH, FRESULT_str(fr), fr);
+        return 0;
+    }
+
+    FSIZE_t size = (FSIZE_t)(WRITE_LOG_ALIGN + WRITE_LOG_SECTORS) * BLOCK_SIZE;
+    bool created = !f_size(&fil);
+    if (created) {
+        fr = f_expand(&fil, size, 1);
+        if (fr != FR_OK) {
+            printf("f_expand(%s) error: %s (%d)\n", WRITE_LOG_PATH, FRESULT_str(fr), fr);
+            f_close(&fil);
+            f_unlink(WRITE_LOG_PATH);
+            return 0;
+        }
+    }
+
+    //  A single fragment, the log is written by sector number
+    DWORD linkmap[4] = { 4 };
+    fil.cltbl = linkmap;
+    fr = f_size(&fil) == size ? f_lseek(&fil, CREATE_LINKMAP) : FR_INVALID_OBJECT;
+    f_close(&fil);
+    if (fr != FR_OK) {
+        printf("  Write Log Not Usable\n");
+        return 0;
+    }
+    if (created) {
+        f_chmod(WRITE_LOG_PATH, AM_HID | AM_SYS, AM_HID | AM_SYS);
+    }
+
+    wlog.pdrv = fs->pdrv;
+    wlog.file_start = fs->database + (LBA_t)fs->csize * (linkmap[2] - 2);
+    wlog.file_end = wlog.file_start + size / BLOCK_SIZE;
+    wlog.volume_start = fs->volbase;
+    wlog.volume_end = fs->database + (LBA_t)fs->csize * (fs->n_fatent - 2);
+    wlog.base = (wlog.file_start + WRITE_LOG_ALIGN - 1) / WRITE_LOG_ALIGN * WRITE_LOG_ALIGN;
+
+    wlog.replayed = created ? 0 : replay();
+    for (int tries = 1; wlog.replayed < 0 && tries < REPLAY_TRIES; tries++) {
+        sleep_ms(100);
+        wlog.replayed = replay();
+    }
+    if (wlog.replayed < 0) {
+        //  A direct write would be undone by the replay on the next mount
+        printf("Write Log Replay Failed\n");
+        wlog.blocked = true;
+        return -1;
+    }
+
+    wlog.enabled = true;
+    if (retire() != RES_OK) {
+        wlog.blocked = wlog.replayed > 0;
+        return wlog.blocked ? -1 : 0;
+    }
+    printf("Write Log(Sector=%lu)\n", (unsigned long)wlog.base);
+    return wlog.replayed;
+}
+
+//  Older copies of the sector are superseded, there is only one per home sector
+static void forget(LBA_t sector) {
+    for (UINT i = 1; i < wlog.head; i++) {
+        if (wlog.home[i] == sector) {
+            if (is_pending(i)) {
+                set_pending(i, false);
+                wlog.staged--;
+            }
+            wlog.home[i] = NO_SECTOR;
+        }
+    }
+}
+
+DRESULT write_log_append(BYTE pdrv, UINT count, const LBA_t *sectors, const BYTE *const *data) {
+    if (!wlog.enabled || pdrv != wlog.pdrv || !count || count > WRITE_LOG_RUN) {
+        return RES_NOTRDY;
+    }
+    for (UINT k = 0; k < count; k++) {
+        if (sectors[k] >= wlog.file_start && sectors[k] < wlog.file_end) {
+            return RES_NOTRDY;
+        }
+    }
+
+    //  Full, the merge would have to happen anyway
+    if (wlog.head + 1 + count > WRITE_LOG_SECTORS) {
+        DRESULT result = drain();
+        if (result != RES_OK || !wlog.enabled) {
+            return RES_NOTRDY;
+        }
+    }
+
+    log_header header = { .epoch = wlog.epoch, .seq = wlog.seq, .count = count };
+    memcpy(header.magic, WRITE_LOG_MAGIC, sizeof(header.magic));
+    for (UINT k = 0; k < count; k++) {
+        header.sectors[k] = sectors[k];
+        memcpy(&buffer[(k + 1) * BLOCK_SIZE], data[k], BLOCK_SIZE);
+    }
+    header.sum = checksum(&header, &buffer[BLOCK_SIZE]);
+    memset(buffer, 0x00, BLOCK_SIZE);
+    memcpy(buffer, &header, sizeof(header));
+
+    DRESULT result = sd_disk_write(pdrv, buffer, wlog.base + wlog.head, count + 1);
+    if (result != RES_OK) {
+        return result;
+    }
+
+    for (UINT k = 0; k < count; k++) {
+        forget(sectors[k]);
+        UINT slot = wlog.head + 1 + k;
+        wlog.home[slot] = sectors[k];
+        set_pending(slot, true);
+        wlog.staged++;
+    }
+    wlog.head += count + 1;
+    wlog.seq++;
+    wlog.appends++;
+    wlog.sectors += count;
+    return RES_OK;
+}
+
+DRESULT write_log_patch(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+    if (!wlog.enabled || pdrv != wlog.pdrv || !wlog.staged) {
+        return RES_OK;
+    }
+
+    for (UINT i = 1; i < wlog.head; i++) {
+        if (is_pending(i) && wlog.home[i] >= sector && wlog.home[i] < sector + count) {
+            DRESULT result = sd_disk_read(pdrv, &buff[(wlog.home[i] - sector) * BLOCK_SIZE], wlog.base + i, 1);
+            if (result != RES_OK) {
+                return result;
+            }
+            wlog.patched++;
+        }
+    }
+    return RES_OK;
+}
+
+DRESULT write_log_before_write(BYTE pdrv, LBA_t sector, UINT count) {
+    if (wlog.blocked && pdrv == wlog.pdrv) {
+        return RES_WRPRT;
+    }
+    if (!wlog.enabled || pdrv != wlog.pdrv) {
+        return RES_OK;
+    }
+
+    //  The clusters are reused, the file was deleted over USB
+    if (sector < wlog.file_end && sector + count > wlog.file_start) {
+        DRESULT result = drain();
+        printf("Write Log Disabled\n");
+        wlog.enabled = false;
+        return result;
+    }
+
+    for (UINT i = 1; i < wlog.head; i++) {
+        if (wlog.home[i] != NO_SECTOR && wlog.home[i] >= sector && wlog.home[i] < sector + count) {
+            return drain();
+        }
+    }
+    return RES_OK;
+}
+
+bool write_log_task(void) {
+    if (!wlog.enabled || wlog.head == 1) {
+        return false;
+    }
+
+    DRESULT result = wlog.staged ? merge_batch() : retire();
+    if (result != RES_OK) {
+        printf("Write Log error: %d\n", result);
+    }
+    return true;
+}
+
+void write_log_print_stats(void) {
+#if IO_STATS
+    if (!wlog.enabled) {
+        return;
+    }
+    printf("write_log:, Appends, %lu, Sectors, %lu, Merges, %lu, Merged, %lu, Patched, %lu, Drains, %lu, Staged, %u, Replayed, %d,\n",
+        wlog.appends, wlog.sectors, wlog.merges, wlog.merged, wlog.patched, wlog.drains, wlog.staged, wlog.replayed);
+#endif
+}
@@ -0,0 +1,56 @@
+/*
+
+MIT License
+
+Copyright (c) 2025 Michael Neil (Far Left Lane)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+*/
+
+#ifndef _WRITE_LOG_H
+#define _WRITE_LOG_H
+
+#include <stdbool.h>    //  For bool
+#include <ff.h>         //  For FATFS
+#include <diskio.h>     //  For DRESULT
+
+#define WRITE_LOG_RUN   8       //  Sectors per append and per merge batch
+
+
+//  Open or create the log on a mounted volume and replay what a power loss left
+//  in it, returns the sectors replayed, the volume has to be mounted again if any,
+//  or -1 if the replay failed and nothing may be written to the volume
+extern int write_log_mount(FATFS *fs);
+
+//  Append sectors to the log instead of writing them home, RES_NOTRDY if it can't take them
+extern DRESULT write_log_append(BYTE pdrv, UINT count, const LBA_t *sectors, const BYTE *const *data);
+
+//  Replace what was just read from home with the newer copies in the log
+extern DRESULT write_log_patch(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
+
+//  Call before writing home directly, merges the whole log if it holds any of the sectors
+extern DRESULT write_log_before_write(BYTE pdrv, LBA_t sector, UINT count);
+
+//  Merge one sorted batch home, returns false if there was nothing to do
+extern bool write_log_task(void);
+
+extern void write_log_print_stats(void);
+
+#endif //   _WRITE_LOG_H